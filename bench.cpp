@@ -0,0 +1,324 @@
+#include "nrex.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+#include <string>
+#include <vector>
+
+// Every allocation made while matching goes through the global operator
+// new unless NREX_NEW was changed, so counting them here is enough.
+static long allocations = 0;
+
+#if __cplusplus < 201103L
+#define BENCH_THROW throw(std::bad_alloc)
+#define BENCH_NOTHROW throw()
+#else
+#define BENCH_THROW
+#define BENCH_NOTHROW noexcept
+#endif
+
+void* operator new(std::size_t size) BENCH_THROW
+{
+    ++allocations;
+    void* data = std::malloc(size ? size : 1);
+    if (!data)
+    {
+        throw std::bad_alloc();
+    }
+    return data;
+}
+
+void operator delete(void* data) BENCH_NOTHROW
+{
+    std::free(data);
+}
+
+#if __cplusplus >= 201402L
+void operator delete(void* data, std::size_t) noexcept
+{
+    std::free(data);
+}
+#endif
+
+struct random_source
+{
+        unsigned int state;
+
+        random_source(unsigned int seed)
+            : state(seed)
+        {
+        }
+
+        unsigned int next(unsigned int range)
+        {
+            state = state * 1103515245u + 12345u;
+            return (state >> 8) % range;
+        }
+};
+
+static const char* const words[] = {
+    "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as",
+    "was", "with", "be", "by", "on", "not", "he", "this", "are", "or",
+    "his", "from", "at", "which", "but", "have", "an", "had", "they",
+    "you", "were", "their", "one", "all", "we", "can", "her", "has",
+    "there", "been", "if", "more", "when", "will", "would", "who", "so",
+    "morning", "evening", "something", "nothing", "Holmes", "Watson",
+    "London", "Baker", "Street", "singing", "walking", "letter", "window"
+};
+
+static const char* const levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+
+static const char* const users[] = { "alice", "bob", "carol", "dave", "erin", "mallory" };
+
+static std::string make_logs(size_t size)
+{
+    random_source random(1);
+    std::string text;
+    char line[160];
+    while (text.size() < size)
+    {
+        snprintf(line, sizeof(line), "2016-%02u-%02u %02u:%02u:%02u %s [worker-%u] request id=%u user=%s@example.com took %ums status=%u\n",
+                 1 + random.next(12), 1 + random.next(28), random.next(24), random.next(60), random.next(60),
+                 levels[random.next(sizeof(levels) / sizeof(levels[0]))], random.next(16), random.next(100000),
+                 users[random.next(sizeof(users) / sizeof(users[0]))], random.next(2000),
+                 random.next(10) ? 200 : 500 + random.next(4));
+        text += line;
+    }
+    text.resize(size);
+    return text;
+}
+
+static std::string make_english(size_t size)
+{
+    random_source random(2);
+    std::string text;
+    bool capital = true;
+    while (text.size() < size)
+    {
+        std::string word = words[random.next(sizeof(words) / sizeof(words[0]))];
+        if (capital && word[0] >= 'a')
+        {
+            word[0] = word[0] - 'a' + 'A';
+        }
+        text += word;
+        capital = false;
+        switch (random.next(16))
+        {
+            case 0:
+                text += ". ";
+                capital = true;
+                break;
+            case 1:
+                text += ", ";
+                break;
+            case 2:
+                text += "\n";
+                break;
+            default:
+                text += " ";
+        }
+    }
+    text.resize(size);
+    return text;
+}
+
+static std::string make_dna(size_t size)
+{
+    random_source random(3);
+    std::string text(size, 'A');
+    for (size_t i = 0; i < size; ++i)
+    {
+        text[i] = "ACGT"[random.next(4)];
+    }
+    return text;
+}
+
+static std::string make_bytes(size_t size)
+{
+    random_source random(4);
+    std::string text(size, ' ');
+    for (size_t i = 0; i < size; ++i)
+    {
+        text[i] = char(1 + random.next(255));
+    }
+    return text;
+}
+
+struct bench_case
+{
+        const char* corpus;
+        const char* pattern;
+};
+
+// The pathological corpus is short on purpose, as the time taken by the
+// patterns run on it grows quickly with its length.
+static const bench_case cases[] = {
+    { "logs", "ERROR" },
+    { "logs", "\\d{4}-\\d{2}-\\d{2}" },
+    { "logs", "user=(\\w+)@(\\w+)\\.com" },
+    { "logs", "status=5\\d\\d" },
+    { "logs", "took (\\d+)ms(?= status=500)" },
+    { "logs", "FATAL|PANIC" },
+    { "english", "Holmes|Watson|London" },
+    { "english", "\\b\\w+ing\\b" },
+    { "english", "[A-Z][a-z]+ [A-Z][a-z]+" },
+    { "english", "(\\w+) \\1" },
+    { "english", "Moriarty" },
+    { "dna", "ACGTACGT" },
+    { "dna", "[AG]GG[CT]" },
+    { "dna", "(?:AC|GT){4}" },
+    { "dna", "A.{5}T.{5}G" },
+    { "dna", "GATTACAGATTACA" },
+    { "bytes", "abc" },
+    { "bytes", "[0-9a-f]{6}" },
+    { "bytes", "[^\\w\\s]{8}" },
+    { "pathological", "(x+x+)+y" },
+    { "pathological", "(a|aa)+b" },
+    { "pathological", "(x+x+)+(?<=y)" },
+    { "pathological", "(x+x+)+\\1y" },
+    { "pathological", "(.*,){12}z" },
+};
+
+static double seconds_since(clock_t start)
+{
+    return double(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static bool count_match(const nrex_result*, void* data)
+{
+    ++*(long*)data;
+    return true;
+}
+
+static void print_json_string(const char* text)
+{
+    putchar('"');
+    for (; *text; ++text)
+    {
+        if (*text == '"' || *text == '\\')
+        {
+            putchar('\\');
+        }
+        putchar(*text);
+    }
+    putchar('"');
+}
+
+// Each pattern's required literal is put at the end, where it cannot
+// complete a match, so the prefilters do not rule the text out before
+// the engines run.
+static std::string make_pathological()
+{
+    std::string text(28, 'x');
+    text += std::string(28, 'a');
+    for (int i = 0; i < 16; ++i)
+    {
+        text += "x,";
+    }
+    return text + "ybz";
+}
+
+int main(int argc, char** argv)
+{
+    size_t size = 1 << 20;
+    if (argc > 1)
+    {
+        size = (size_t)atol(argv[1]) << 10;
+    }
+    long step_limit = 10000000;
+
+    std::vector<std::string> names;
+    std::vector<std::string> corpora;
+    names.push_back("logs");
+    corpora.push_back(make_logs(size));
+    names.push_back("english");
+    corpora.push_back(make_english(size));
+    names.push_back("dna");
+    corpora.push_back(make_dna(size));
+    names.push_back("bytes");
+    corpora.push_back(make_bytes(size));
+    names.push_back("pathological");
+    corpora.push_back(make_pathological());
+
+    printf("{\n  \"corpus_size\": %lu,\n  \"step_limit\": %ld,\n  \"results\": [", (unsigned long)size, step_limit);
+    for (unsigned int i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    {
+        const bench_case& test = cases[i];
+        const std::string* corpus = NULL;
+        for (unsigned int j = 0; j < names.size(); ++j)
+        {
+            if (names[j] == test.corpus)
+            {
+                corpus = &corpora[j];
+            }
+        }
+        const char* str = corpus->c_str();
+        int end = (int)corpus->size();
+        double megabytes = corpus->size() / 1048576.0;
+
+        nrex regex;
+        long compiles = 0;
+        clock_t start = clock();
+        do
+        {
+            regex.compile(test.pattern);
+            ++compiles;
+        }
+        while (seconds_since(start) < 0.05);
+        double compile_us = seconds_since(start) * 1e6 / compiles;
+
+        nrex_match_context context;
+        context.set_step_limit(step_limit);
+        std::vector<nrex_result> captures(regex.capture_size());
+        bool found = regex.match(str, &captures[0], 0, end, &context);
+        bool aborted = context.aborted();
+        long firsts = 0;
+        start = clock();
+        do
+        {
+            regex.match(str, &captures[0], 0, end, &context);
+            ++firsts;
+        }
+        while (seconds_since(start) < 0.05);
+        double first_us = seconds_since(start) * 1e6 / firsts;
+
+        long matches = 0;
+        regex.match_all(str, count_match, &matches, 0, end, &context);
+        aborted = aborted || context.aborted();
+        long counted = 0;
+        long runs = 0;
+        long before = allocations;
+        start = clock();
+        do
+        {
+            regex.match_all(str, count_match, &counted, 0, end, &context);
+            ++runs;
+        }
+        while (seconds_since(start) < 0.05);
+        double all_seconds = seconds_since(start) / runs;
+        double all_allocations = double(allocations - before) / runs;
+
+        long tests = 0;
+        start = clock();
+        do
+        {
+            regex.test(str, 0, end, &context);
+            ++tests;
+        }
+        while (seconds_since(start) < 0.05);
+        double test_seconds = seconds_since(start) / tests;
+
+        printf("%s\n    {\"corpus\": ", i ? "," : "");
+        print_json_string(test.corpus);
+        printf(", \"pattern\": ");
+        print_json_string(test.pattern);
+        printf(", \"found\": %s, \"aborted\": %s, \"matches\": %ld,", found ? "true" : "false", aborted ? "true" : "false", matches);
+        printf(" \"compile_us\": %.3f, \"first_match_us\": %.3f,", compile_us, first_us);
+        printf(" \"match_all_mbps\": %.2f, \"test_mbps\": %.2f,", megabytes / all_seconds, megabytes / test_seconds);
+        printf(" \"allocations_per_match\": %.3f}", all_allocations / (matches ? matches : 1));
+        fflush(stdout);
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -26,19 +26,36 @@
 
 #include "nrex.hpp"
 #include <climits>
+#include <string.h>
+#include <new>
 
 #ifdef NREX_UNICODE
-#include <wctype.h>
 #include <wchar.h>
-#define NREX_ISALPHANUM iswalnum
-#define NREX_ISSPACE iswspace
 #define NREX_STRLEN wcslen
+#define NREX_MEMCHR wmemchr
+#define NREX_MEMCMP wmemcmp
 #else
-#include <ctype.h>
-#include <string.h>
-#define NREX_ISALPHANUM isalnum
-#define NREX_ISSPACE isspace
 #define NREX_STRLEN strlen
+#define NREX_MEMCHR memchr
+#define NREX_MEMCMP memcmp
+#endif
+
+// The character a single step of the matchers consumes. In UTF-8 mode this
+// is a decoded code point while the text itself stays in bytes.
+#ifdef NREX_UTF8
+typedef int nrex_point;
+#define NREX_CHAR_KIND 8
+// Bytes that do not form valid UTF-8 are read one at a time as a code
+// point above the Unicode range, so they never equal a real character.
+#define NREX_INVALID_UTF8 0x110000
+#else
+typedef nrex_char nrex_point;
+#define NREX_CHAR_KIND int(sizeof(nrex_char))
+#endif
+
+#if defined(__SSSE3__) && !defined(NREX_UNICODE)
+#include <tmmintrin.h>
+#define NREX_SSSE3
 #endif
 
 #ifdef NREX_THROW_ERROR
@@ -61,11 +78,13 @@ class nrex_array
         T* _data;
         unsigned int _reserved;
         unsigned int _size;
+        bool _borrowed;
     public:
         nrex_array()
-            : _data(NREX_NEW_ARRAY(T, 2))
-            , _reserved(2)
+            : _data(NULL)
+            , _reserved(0)
             , _size(0)
+            , _borrowed(false)
         {
         }
 
@@ -73,12 +92,28 @@ class nrex_array
             : _data(NREX_NEW_ARRAY(T, reserved ? reserved : 1))
             , _reserved(reserved ? reserved : 1)
             , _size(0)
+            , _borrowed(false)
         {
         }
 
         ~nrex_array()
         {
-            NREX_DELETE_ARRAY(_data);
+            if (_data && !_borrowed)
+            {
+                NREX_DELETE_ARRAY(_data);
+            }
+        }
+
+        void borrow(const T* data, unsigned int size)
+        {
+            if (_data && !_borrowed)
+            {
+                NREX_DELETE_ARRAY(_data);
+            }
+            _data = const_cast<T*>(data);
+            _reserved = size;
+            _size = size;
+            _borrowed = true;
         }
 
         unsigned int size() const
@@ -101,14 +136,18 @@ class nrex_array
             {
                 _data[i] = old[i];
             }
-            NREX_DELETE_ARRAY(old);
+            if (old && !_borrowed)
+            {
+                NREX_DELETE_ARRAY(old);
+            }
+            _borrowed = false;
         }
 
         void push(T item)
         {
             if (_size == _reserved)
             {
-                reserve(_reserved * 2);
+                reserve(_reserved ? _reserved * 2 : 2);
             }
             _data[_size] = item;
             _size++;
@@ -124,6 +163,11 @@ class nrex_array
             return _data[i];
         }
 
+        T& operator[] (unsigned int i)
+        {
+            return _data[i];
+        }
+
         void pop()
         {
             if (_size > 0)
@@ -131,8 +175,142 @@ class nrex_array
                 --_size;
             }
         }
+
+        void clear()
+        {
+            _size = 0;
+        }
+
+        void resize(unsigned int size)
+        {
+            if (size > _reserved)
+            {
+                reserve(size);
+            }
+            _size = size;
+        }
+};
+
+// Blocks that are carved up into pieces of different types are made of
+// these, so every piece can start on a boundary any of them is happy with.
+union nrex_arena_align
+{
+        void* pointer;
+        double real;
+        long integer;
 };
 
+#ifdef NREX_UTF8
+static int nrex_decode(const nrex_char* str, int pos, int end, nrex_point* c)
+{
+    static const int least[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+    unsigned char lead = (unsigned char)str[pos];
+    if (lead < 0x80)
+    {
+        *c = lead;
+        return pos + 1;
+    }
+    int length = (lead >= 0xF0) ? 4 : (lead >= 0xE0) ? 3 : 2;
+    int point = lead & (0x3F >> (length - 1));
+    bool valid = (0xC2 <= lead && lead <= 0xF4);
+    for (int i = 1; valid && i < length; ++i)
+    {
+        unsigned char next = (pos + i < end) ? (unsigned char)str[pos + i] : 0;
+        valid = ((next & 0xC0) == 0x80);
+        point = (point << 6) | (next & 0x3F);
+    }
+    if (!valid || point < least[length] || point > 0x10FFFF || (0xD800 <= point && point <= 0xDFFF))
+    {
+        *c = NREX_INVALID_UTF8 + lead;
+        return pos + 1;
+    }
+    *c = point;
+    return pos + length;
+}
+#endif
+
+static int nrex_next(const nrex_char* str, int pos, int end, nrex_point* c)
+{
+#ifdef NREX_UTF8
+    if ((unsigned char)str[pos] >= 0x80)
+    {
+        return nrex_decode(str, pos, end, c);
+    }
+#else
+    (void)end;
+#endif
+    *c = str[pos];
+    return pos + 1;
+}
+
+static int nrex_skip(const nrex_char* str, int pos, int end)
+{
+    nrex_point c;
+    return (pos < end) ? nrex_next(str, pos, end, &c) : pos + 1;
+}
+
+static int nrex_prev(const nrex_char* str, int pos, nrex_point* c)
+{
+#ifdef NREX_UTF8
+    if ((unsigned char)str[pos - 1] >= 0x80)
+    {
+        int start = pos - 1;
+        while (start > 0 && pos - start < 4 && ((unsigned char)str[start] & 0xC0) == 0x80)
+        {
+            --start;
+        }
+        if (nrex_decode(str, start, pos, c) == pos)
+        {
+            return start;
+        }
+        nrex_decode(str, pos - 1, pos, c);
+    }
+    else
+    {
+        *c = str[pos - 1];
+    }
+#else
+    *c = str[pos - 1];
+#endif
+    return pos - 1;
+}
+
+static int nrex_encode(nrex_point c, nrex_char* out)
+{
+#ifdef NREX_UTF8
+    static const int leads[5] = { 0, 0, 0xC0, 0xE0, 0xF0 };
+    if (c >= NREX_INVALID_UTF8)
+    {
+        out[0] = nrex_char(c - NREX_INVALID_UTF8);
+        return 1;
+    }
+    if (c >= 0x80)
+    {
+        int length = (c < 0x800) ? 2 : (c < 0x10000) ? 3 : 4;
+        for (int i = length - 1; i > 0; --i)
+        {
+            out[i] = nrex_char(0x80 | (c & 0x3F));
+            c >>= 6;
+        }
+        out[0] = nrex_char(leads[length] | c);
+        return length;
+    }
+#endif
+    out[0] = nrex_char(c);
+    return 1;
+}
+
+static bool nrex_read_point(const nrex_char*& c, nrex_point* point)
+{
+#ifdef NREX_UTF8
+    c += nrex_decode(c, 0, INT_MAX, point) - 1;
+    return *point < NREX_INVALID_UTF8;
+#else
+    *point = c[0];
+    return true;
+#endif
+}
+
 static int nrex_parse_hex(nrex_char c)
 {
     if ('0' <= c && c <= '9')
@@ -150,7 +328,7 @@ static int nrex_parse_hex(nrex_char c)
     return -1;
 }
 
-static nrex_char nrex_unescape(const nrex_char*& c)
+static nrex_point nrex_unescape(const nrex_char*& c)
 {
     switch (c[1])
     {
@@ -176,7 +354,7 @@ static nrex_char nrex_unescape(const nrex_char*& c)
                 point = (point << 4) + res;
             }
             c = &c[3];
-            return nrex_char(point);
+            return nrex_point(point);
         }
         case 'u':
         {
@@ -191,351 +369,473 @@ static nrex_char nrex_unescape(const nrex_char*& c)
                 point = (point << 4) + res;
             }
             c = &c[5];
-            return nrex_char(point);
+            return nrex_point(point);
         }
     }
-    return (++c)[0];
+    nrex_point point;
+    nrex_read_point(++c, &point);
+    return point;
 }
 
-struct nrex_search
+struct nrex_charset
 {
-        const nrex_char* str;
-        nrex_result* captures;
-        int end;
-        bool complete;
-        nrex_array<int> lookahead_pos;
+        unsigned char bits[32];
+        bool wide;
+#ifdef NREX_SSSE3
+        unsigned char low_nibbles[2][16];
+        unsigned char high_nibbles[16];
+#endif
 
-        nrex_char at(int pos)
+        nrex_charset()
+            : wide(false)
         {
-            return str[pos];
+            for (int i = 0; i < 32; ++i)
+            {
+                bits[i] = 0;
+            }
         }
 
-        nrex_search(const nrex_char* str, nrex_result* captures, int lookahead)
-            : str(str)
-            , captures(captures)
-            , end(0)
-            , lookahead_pos(lookahead)
+        void add(nrex_point c)
         {
+#ifdef NREX_UTF8
+            if (c >= 0x80)
+            {
+                widen();
+                return;
+            }
+#endif
+            if ((unsigned int)c > 0xFF && sizeof(nrex_char) > 1)
+            {
+                wide = true;
+                return;
+            }
+            unsigned char b = (unsigned char)c;
+            bits[b >> 3] |= (unsigned char)(1 << (b & 7));
         }
-};
 
-struct nrex_node
-{
-        nrex_node* next;
-        nrex_node* previous;
-        nrex_node* parent;
-        bool quantifiable;
-        int length;
+        // In UTF-8 mode the set is searched for in raw bytes, so a match
+        // starting with any character above ASCII may start with any byte
+        // above ASCII.
+        void widen()
+        {
+#ifdef NREX_UTF8
+            for (int i = 16; i < 32; ++i)
+            {
+                bits[i] = 0xFF;
+            }
+#endif
+            wide = true;
+        }
 
-        nrex_node(bool quantify = false)
-            : next(NULL)
-            , previous(NULL)
-            , parent(NULL)
-            , quantifiable(quantify)
-            , length(-1)
+        bool contains(nrex_char c) const
         {
+            if ((unsigned int)c > 0xFF && sizeof(nrex_char) > 1)
+            {
+                return wide;
+            }
+            unsigned char b = (unsigned char)c;
+            return (bits[b >> 3] & (1 << (b & 7))) != 0;
         }
 
-        virtual ~nrex_node()
+        void fill()
         {
-            if (next)
+            for (int i = 0; i < 32; ++i)
             {
-                NREX_DELETE(next);
+                bits[i] = 0xFF;
             }
+            wide = true;
         }
 
-        virtual int test(nrex_search* s, int pos) const
+        void invert()
         {
-            return next ? next->test(s, pos) : -1;
+            for (int i = 0; i < 32; ++i)
+            {
+                bits[i] = (unsigned char)~bits[i];
+            }
+            widen();
         }
 
-        virtual int test_parent(nrex_search* s, int pos) const
+        void merge(const nrex_charset& other)
         {
-            if (next)
+            for (int i = 0; i < 32; ++i)
             {
-                pos = next->test(s, pos);
+                bits[i] |= other.bits[i];
             }
-            if (pos >= 0)
+            wide = wide || other.wide;
+        }
+
+        bool full() const
+        {
+            for (int i = 0; i < 32; ++i)
             {
-                s->complete = true;
+                if (bits[i] != 0xFF)
+                {
+                    return false;
+                }
             }
-            if (parent && pos >= 0)
+            return wide;
+        }
+
+        void prepare()
+        {
+#ifdef NREX_SSSE3
+            for (int i = 0; i < 16; ++i)
             {
-                pos = parent->test_parent(s, pos);
+                low_nibbles[0][i] = 0;
+                low_nibbles[1][i] = 0;
+                high_nibbles[i] = (unsigned char)(1 << (i & 7));
             }
-            if (pos < 0)
+            for (int b = 0; b < 256; ++b)
             {
-                s->complete = false;
+                if (bits[b >> 3] & (1 << (b & 7)))
+                {
+                    low_nibbles[b >> 7][b & 15] |= (unsigned char)(1 << ((b >> 4) & 7));
+                }
             }
-            return pos;
+#endif
         }
 
-        void increment_length(int amount, bool subtract = false)
+        int scan(const nrex_char* str, int pos, int end) const
         {
-            if (amount >= 0 && length >= 0)
+#ifdef NREX_SSSE3
+            const __m128i low_mask = _mm_set1_epi8(0x0F);
+            const __m128i low0 = _mm_loadu_si128((const __m128i*)low_nibbles[0]);
+            const __m128i low1 = _mm_loadu_si128((const __m128i*)low_nibbles[1]);
+            const __m128i high = _mm_loadu_si128((const __m128i*)high_nibbles);
+            for (; pos + 16 <= end; pos += 16)
             {
-                if (!subtract)
-                {
-                    length += amount;
-                }
-                else
+                __m128i v = _mm_loadu_si128((const __m128i*)&str[pos]);
+                __m128i lo = _mm_and_si128(v, low_mask);
+                __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low_mask);
+                __m128i upper = _mm_cmplt_epi8(v, _mm_setzero_si128());
+                __m128i rows = _mm_or_si128(
+                        _mm_andnot_si128(upper, _mm_shuffle_epi8(low0, lo)),
+                        _mm_and_si128(upper, _mm_shuffle_epi8(low1, lo)));
+                __m128i hits = _mm_and_si128(rows, _mm_shuffle_epi8(high, hi));
+                int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(hits, _mm_setzero_si128())) ^ 0xFFFF;
+                if (mask)
                 {
-                    length -= amount;
+                    return pos + __builtin_ctz(mask);
                 }
             }
-            else
-            {
-                length = -1;
-            }
-            if (parent)
+#endif
+            for (; pos < end; ++pos)
             {
-                parent->increment_length(amount, subtract);
+                if (contains(str[pos]))
+                {
+                    return pos;
+                }
             }
+            return end;
         }
 };
 
-enum nrex_group_type
-{
-    nrex_group_capture,
-    nrex_group_non_capture,
-    nrex_group_bracket,
-    nrex_group_look_ahead,
-    nrex_group_look_behind
-};
+#define NREX_PREFIX_LENGTH 16
+#define NREX_PREFIX_COUNT 256
 
-struct nrex_node_group : public nrex_node
+struct nrex_literals
 {
-        nrex_group_type type;
-        int id;
-        bool negate;
-        nrex_array<nrex_node*> childset;
-        nrex_node* back;
+        nrex_array<nrex_char> chars;
+        nrex_array<int> lengths;
+        nrex_array<int> table;
+        nrex_array<int> fail;
+        nrex_array<int> out;
+        unsigned char map[256];
+        // Characters above 0xFF in the literals get a column each after
+        // the bytes, looked up in this sorted list.
+        nrex_array<nrex_char> wide;
+        int wide_base;
+        int stride;
+        int longest;
 
-        nrex_node_group(nrex_group_type type, int id = 0)
-            : nrex_node(true)
-            , type(type)
-            , id(id)
-            , negate(false)
-            , back(NULL)
+        nrex_literals()
+            : wide_base(0)
+            , stride(1)
+            , longest(0)
         {
-            if (type != nrex_group_bracket)
+            memset(map, 0, sizeof(map));
+        }
+
+        bool add(const nrex_char* literal, int length)
+        {
+            if (lengths.size() >= NREX_PREFIX_COUNT || length <= 0 || length > NREX_PREFIX_LENGTH)
             {
-                length = 0;
+                return false;
             }
-            else
+            for (int i = 0; i < length; ++i)
             {
-                length = 1;
+                chars.push(literal[i]);
             }
-            if (type == nrex_group_look_ahead || type == nrex_group_look_behind)
+            lengths.push(length);
+            return true;
+        }
+
+        bool useful() const
+        {
+            for (unsigned int i = 0; i < lengths.size(); ++i)
             {
-                quantifiable = false;
+                if (lengths[i] < 2)
+                {
+                    return false;
+                }
             }
+            return lengths.size() >= 2;
         }
 
-        virtual ~nrex_node_group()
+        int state()
         {
-            for (unsigned int i = 0; i < childset.size(); ++i)
+            for (int i = 0; i < stride; ++i)
             {
-                NREX_DELETE(childset[i]);
+                table.push(-1);
             }
+            fail.push(0);
+            out.push(0);
+            return out.size() - 1;
+        }
 
+        int column(nrex_char c) const
+        {
+            if (sizeof(nrex_char) == 1 || (unsigned int)c <= 0xFF)
+            {
+                return map[(unsigned char)c];
+            }
+            int low = 0;
+            int high = wide.size();
+            while (low < high)
+            {
+                int mid = (low + high) / 2;
+                if (wide[mid] < c)
+                {
+                    low = mid + 1;
+                }
+                else
+                {
+                    high = mid;
+                }
+            }
+            return (low < (int)wide.size() && wide[low] == c) ? wide_base + low : 0;
         }
 
-        int test(nrex_search* s, int pos) const
+        void build()
         {
-            int old_start;
-            if (type == nrex_group_capture)
+            memset(map, 0, sizeof(map));
+            wide.clear();
+            stride = 1;
+            for (unsigned int i = 0; i < chars.size(); ++i)
             {
-                old_start = s->captures[id].start;
-                s->captures[id].start = pos;
+                nrex_char c = chars[i];
+                if (sizeof(nrex_char) > 1 && (unsigned int)c > 0xFF)
+                {
+                    int at = wide.size();
+                    while (at > 0 && c < wide[at - 1])
+                    {
+                        --at;
+                    }
+                    if (at == 0 || wide[at - 1] != c)
+                    {
+                        wide.push(c);
+                        for (int j = wide.size() - 1; j > at; --j)
+                        {
+                            wide[j] = wide[j - 1];
+                        }
+                        wide[at] = c;
+                    }
+                }
+                else if (!map[(unsigned char)c])
+                {
+                    map[(unsigned char)c] = (unsigned char)stride++;
+                }
             }
-            for (unsigned int i = 0; i < childset.size(); ++i)
+            wide_base = stride;
+            stride += wide.size();
+            table.clear();
+            fail.clear();
+            out.clear();
+            state();
+            longest = 0;
+            int offset = 0;
+            for (unsigned int i = 0; i < lengths.size(); ++i)
             {
-                s->complete = false;
-                int offset = 0;
-                if (type == nrex_group_look_behind)
+                int current = 0;
+                for (int j = 0; j < lengths[i]; ++j)
                 {
-                    if (pos < length)
+                    int entry = current * stride + column(chars[offset + j]);
+                    if (table[entry] < 0)
                     {
-                        return -1;
+                        int next = state();
+                        table[entry] = next;
                     }
-                    offset = length;
+                    current = table[entry];
                 }
-                if (type == nrex_group_look_ahead)
+                if (out[current] < lengths[i])
                 {
-                    s->lookahead_pos.push(pos);
+                    out[current] = lengths[i];
                 }
-                int res = childset[i]->test(s, pos - offset);
-                if (type == nrex_group_look_ahead)
+                if (longest < lengths[i])
                 {
-                    s->lookahead_pos.pop();
+                    longest = lengths[i];
                 }
-                if (s->complete)
+                offset += lengths[i];
+            }
+            nrex_array<int> queue;
+            for (int c = 0; c < stride; ++c)
+            {
+                if (table[c] < 0)
                 {
-                    return res;
+                    table[c] = 0;
                 }
-                if (negate)
+                else
+                {
+                    queue.push(table[c]);
+                }
+            }
+            for (unsigned int i = 0; i < queue.size(); ++i)
+            {
+                int current = queue[i];
+                if (out[current] == 0)
+                {
+                    out[current] = out[fail[current]];
+                }
+                for (int c = 0; c < stride; ++c)
                 {
-                    if (res < 0)
+                    int entry = current * stride + c;
+                    int fallback = table[fail[current] * stride + c];
+                    if (table[entry] < 0)
                     {
-                        res = pos + 1;
+                        table[entry] = fallback;
                     }
                     else
                     {
-                        return -1;
+                        fail[table[entry]] = fallback;
+                        queue.push(table[entry]);
                     }
-                    if (i + 1 < childset.size())
+                }
+            }
+        }
+
+        int scan(const nrex_char* str, int pos, int end, const nrex_charset* first) const
+        {
+            int current = 0;
+            int best = -1;
+            for (int limit = end; pos < limit; ++pos)
+            {
+                if (current == 0 && first)
+                {
+                    pos = first->scan(str, pos, limit);
+                    if (pos >= limit)
                     {
-                        continue;
+                        break;
                     }
                 }
-                if (res >= 0)
+                current = table[current * stride + column(str[pos])];
+                if (out[current])
                 {
-                    if (type == nrex_group_capture)
+                    int start = pos + 1 - out[current];
+                    if (best < 0 || start < best)
                     {
-                        s->captures[id].length = res - pos;
+                        best = start;
                     }
-                    else if (type == nrex_group_look_ahead || type == nrex_group_look_behind)
+                    if (limit > best + longest - 1)
                     {
-                        res = pos;
+                        limit = best + longest - 1;
                     }
-                    return next ? next->test(s, res) : res;
                 }
             }
-            if (type == nrex_group_capture)
-            {
-                s->captures[id].start = old_start;
-            }
+            return best;
+        }
+};
+
+static int nrex_find_literal(const nrex_char* str, int pos, int end, const nrex_char* literal, int length)
+{
+    while (pos + length <= end)
+    {
+        const nrex_char* hit = (const nrex_char*)NREX_MEMCHR(&str[pos], literal[0], end - length - pos + 1);
+        if (!hit)
+        {
             return -1;
         }
+        pos = int(hit - str);
+        if (NREX_MEMCMP(&hit[1], &literal[1], length - 1) == 0)
+        {
+            return pos;
+        }
+        ++pos;
+    }
+    return -1;
+}
+
+static unsigned int nrex_hash(unsigned int result, const void* data, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        result = (result ^ bytes[i]) * 16777619u;
+    }
+    return result;
+}
+
+#define NREX_BLOB_VERSION 5
+
+struct nrex_writer
+{
+        unsigned char* data;
+        int capacity;
+        int size;
+
+        nrex_writer(void* data, int capacity)
+            : data((unsigned char*)data)
+            , capacity(data ? capacity : 0)
+            , size(0)
+        {
+        }
 
-        virtual int test_parent(nrex_search* s, int pos) const
+        void put(const void* bytes, int count)
         {
-            if (type == nrex_group_capture)
+            int padded = (count + 3) & ~3;
+            if (count > 0 && size + padded <= capacity)
             {
-                s->captures[id].length = pos - s->captures[id].start;
+                memcpy(&data[size], bytes, count);
+                memset(&data[size + count], 0, padded - count);
             }
-            if (type == nrex_group_look_ahead)
-            {
-                pos = s->lookahead_pos[id];
-            }
-            return nrex_node::test_parent(s, pos);
+            size += padded;
         }
 
-        void add_childset()
+        void put_int(int value)
         {
-            if (childset.size() > 0 && type != nrex_group_bracket)
-            {
-                length = -1;
-            }
-            back = NULL;
-        }
-
-        void add_child(nrex_node* node)
-        {
-            node->parent = this;
-            node->previous = back;
-            if (back && type != nrex_group_bracket)
-            {
-                back->next = node;
-            }
-            else
-            {
-                childset.push(node);
-            }
-            if (type != nrex_group_bracket)
-            {
-                increment_length(node->length);
-            }
-            back = node;
-        }
-
-        nrex_node* swap_back(nrex_node* node)
-        {
-            if (!back)
-            {
-                add_child(node);
-                return NULL;
-            }
-            nrex_node* old = back;
-            if (!old->previous)
-            {
-                childset.pop();
-            }
-            if (type != nrex_group_bracket)
-            {
-                increment_length(old->length, true);
-            }
-            back = old->previous;
-            add_child(node);
-            return old;
-        }
-
-        void pop_back()
-        {
-            if (back)
-            {
-                nrex_node* old = back;
-                if (!old->previous)
-                {
-                    childset.pop();
-                }
-                if (type != nrex_group_bracket)
-                {
-                    increment_length(old->length, true);
-                }
-                back = old->previous;
-                NREX_DELETE(old);
-            }
+            put(&value, sizeof(int));
         }
 };
 
-struct nrex_node_char : public nrex_node
+struct nrex_reader
 {
-        nrex_char ch;
+        const unsigned char* data;
+        int size;
+        int pos;
 
-        nrex_node_char(nrex_char c)
-            : nrex_node(true)
-            , ch(c)
+        nrex_reader(const void* data, int size)
+            : data((const unsigned char*)data)
+            , size(size)
+            , pos(0)
         {
-            length = 1;
         }
 
-        int test(nrex_search* s, int pos) const
+        const void* take(int count, int width = 1)
         {
-            if (s->end <= pos || 0 > pos || s->at(pos) != ch)
+            if (count < 0 || count > INT_MAX / width - 3 || pos < 0 || size - pos < count * width)
             {
-                return -1;
+                pos = -1;
+                return NULL;
             }
-            return next ? next->test(s, pos + 1) : pos + 1;
-        }
-};
-
-struct nrex_node_range : public nrex_node
-{
-        nrex_char start;
-        nrex_char end;
-
-        nrex_node_range(nrex_char s, nrex_char e)
-            : nrex_node(true)
-            , start(s)
-            , end(e)
-        {
-            length = 1;
+            count *= width;
+            const void* result = &data[pos];
+            pos += (count + 3) & ~3;
+            return result;
         }
 
-        int test(nrex_search* s, int pos) const
+        int take_int()
         {
-            if (s->end <= pos || 0 > pos)
-            {
-                return -1;
-            }
-            nrex_char c = s->at(pos);
-            if (c < start || end < c)
-            {
-                return -1;
-            }
-            return next ? next->test(s, pos + 1) : pos + 1;
+            const int* value = (const int*)take(sizeof(int));
+            return value ? *value : -1;
         }
 };
 
@@ -557,941 +857,5622 @@ enum nrex_class_type
     nrex_class_word
 };
 
-static bool nrex_compare_class(const nrex_char** pos, const char* text)
+enum nrex_opcode
 {
-    unsigned int i = 0;
-    for (i = 0; text[i] != '\0'; ++i)
-    {
-        if ((*pos)[i] != text[i])
-        {
-            return false;
-        }
-    }
-    if ((*pos)[i++] != ':' || (*pos)[i] != ']')
-    {
-        return false;
-    }
-    *pos = &(*pos)[i];
-    return true;
-}
+    nrex_op_match,
+    nrex_op_char,
+    nrex_op_range,
+    nrex_op_class,
+    nrex_op_shorthand,
+    nrex_op_bracket,
+    nrex_op_split,
+    nrex_op_jump,
+    nrex_op_save,
+    nrex_op_anchor_start,
+    nrex_op_anchor_end,
+    nrex_op_word_boundary,
+    nrex_op_look_ahead,
+    nrex_op_look_behind,
+    nrex_op_look_end,
+    nrex_op_backreference,
+    nrex_op_atomic,
+    nrex_op_span,
+    nrex_op_repeat_init,
+    nrex_op_repeat,
+    nrex_op_progress
+};
 
-#define NREX_COMPARE_CLASS(POS, NAME) if (nrex_compare_class(POS, #NAME)) return nrex_class_ ## NAME
+struct nrex_inst
+{
+        int op;
+        int x;
+        int y;
+        int z;
+};
 
-static nrex_class_type nrex_parse_class(const nrex_char** pos)
+// A bracket keeps a bitmap of its members up to 0xFF with the negation
+// already applied. Wider code points are looked up in the sorted ranges at
+// the start of its items before the remaining classes are tried.
+struct nrex_bracket
 {
-    NREX_COMPARE_CLASS(pos, alnum);
-    NREX_COMPARE_CLASS(pos, alpha);
-    NREX_COMPARE_CLASS(pos, blank);
-    NREX_COMPARE_CLASS(pos, cntrl);
-    NREX_COMPARE_CLASS(pos, digit);
-    NREX_COMPARE_CLASS(pos, graph);
-    NREX_COMPARE_CLASS(pos, lower);
-    NREX_COMPARE_CLASS(pos, print);
-    NREX_COMPARE_CLASS(pos, punct);
-    NREX_COMPARE_CLASS(pos, space);
-    NREX_COMPARE_CLASS(pos, upper);
-    NREX_COMPARE_CLASS(pos, xdigit);
-    NREX_COMPARE_CLASS(pos, word);
-    return nrex_class_none;
-}
+        unsigned char bits[32];
+        int ranges;
+        int negate;
+};
 
-struct nrex_node_class : public nrex_node
+#define NREX_PROGRAM_LIMIT 65536
+
+#ifndef NREX_DFA_CACHE_SIZE
+#define NREX_DFA_CACHE_SIZE 1048576
+#endif
+
+// Shortest text a call without a nrex_match_context builds the DFAs for.
+// Building them costs about as much as running the NFA over a few dozen
+// characters.
+#ifndef NREX_DFA_MIN_TEXT
+#define NREX_DFA_MIN_TEXT 32
+#endif
+
+struct nrex_program
 {
-        nrex_class_type type;
+        nrex_array<nrex_inst> code;
+        nrex_array<nrex_inst> items;
+        nrex_array<nrex_bracket> brackets;
+        int slots;
+        int registers;
+        int depth;
+        int level;
+        bool pike;
+        bool backtrack;
+        bool backward;
+        nrex_program* reverse;
+        unsigned char classmap[256];
+        int classes;
+        nrex_char* literal;
+        int literal_length;
+        int literal_offset;
+        nrex_charset* first;
+        nrex_literals* prefixes;
+        bool anchor_start;
+        int anchor_end;
+        bool anchored_end;
+        bool borrowed;
+        // Set once the arrays, literal and first set have been moved into
+        // the block of the outermost program, which alone owns it.
+        bool packed;
+        nrex_arena_align* storage;
+        unsigned int signature;
+        bool memo;
+        int members;
+#ifdef NREX_INSTRUMENT
+        nrex_array<nrex_char> pattern;
+        nrex_array<int> sources;
+        int source_begin;
+        int source_end;
+#endif
 
-        nrex_node_class(nrex_class_type t)
-            : nrex_node(true)
-            , type(t)
+        nrex_program(int captures)
+            : slots((captures + 1) * 2)
+            , registers((captures + 1) * 2)
+            , depth(0)
+            , level(0)
+            , pike(true)
+            , backtrack(false)
+            , backward(false)
+            , reverse(NULL)
+            , classes(0)
+            , literal(NULL)
+            , literal_length(0)
+            , literal_offset(-1)
+            , first(NULL)
+            , prefixes(NULL)
+            , anchor_start(false)
+            , anchor_end(-1)
+            , anchored_end(false)
+            , borrowed(false)
+            , packed(false)
+            , storage(NULL)
+            , signature(0)
+            , memo(false)
+            , members(0)
         {
-            length = 1;
+            memset(classmap, 0, sizeof(classmap));
+#ifdef NREX_INSTRUMENT
+            source_begin = -1;
+            source_end = -1;
+#endif
         }
 
-        int test(nrex_search* s, int pos) const
+        ~nrex_program()
         {
-            if (s->end <= pos || 0 > pos)
+            if (reverse)
             {
-                return -1;
+                NREX_DELETE(reverse);
             }
-            if (!test_class(s->at(pos)))
+            if (literal && !borrowed && !packed)
             {
-                return -1;
+                NREX_DELETE_ARRAY(literal);
+            }
+            if (first && !packed)
+            {
+                NREX_DELETE(first);
+            }
+            if (prefixes)
+            {
+                NREX_DELETE(prefixes);
+            }
+            if (storage)
+            {
+                NREX_DELETE_ARRAY(storage);
             }
-            return next ? next->test(s, pos + 1) : pos + 1;
         }
 
-        bool test_class(nrex_char c) const
+        static unsigned int padded(unsigned int bytes)
+        {
+            const unsigned int align = sizeof(nrex_arena_align);
+            return (bytes + align - 1) / align * align;
+        }
+
+        unsigned int footprint() const
+        {
+            unsigned int size = padded(code.size() * sizeof(nrex_inst));
+            size += padded(items.size() * sizeof(nrex_inst));
+            size += padded(brackets.size() * sizeof(nrex_bracket));
+            size += padded(literal_length * sizeof(nrex_char));
+            size += first ? padded(sizeof(nrex_charset)) : 0;
+            return reverse ? size + reverse->footprint() : size;
+        }
+
+        template <class T>
+        static void settle(nrex_array<T>& array, char** cursor)
         {
-            if ((0 <= c && c <= 0x1F) || c == 0x7F)
+            T* copy = reinterpret_cast<T*>(*cursor);
+            if (array.size())
             {
-                if (type == nrex_class_cntrl)
-                {
-                    return true;
-                }
+                memcpy(copy, &array[0], array.size() * sizeof(T));
             }
-            else if (c < 0x7F)
+            *cursor += padded(array.size() * sizeof(T));
+            array.borrow(copy, array.size());
+        }
+
+        void settle(char** cursor)
+        {
+            settle(code, cursor);
+            settle(items, cursor);
+            settle(brackets, cursor);
+            if (literal)
             {
-                if (type == nrex_class_print)
-                {
-                    return true;
-                }
-                else if (type == nrex_class_graph && c != ' ')
-                {
-                    return true;
-                }
-                else if ('0' <= c && c <= '9')
-                {
-                    switch (type)
-                    {
-                        case nrex_class_alnum:
-                        case nrex_class_digit:
-                        case nrex_class_xdigit:
-                        case nrex_class_word:
-                            return true;
-                        default:
-                            break;
-                    }
-                }
-                else if ('A' <= c && c <= 'Z')
-                {
-                    switch (type)
-                    {
-                        case nrex_class_alnum:
-                        case nrex_class_alpha:
-                        case nrex_class_upper:
-                        case nrex_class_word:
-                            return true;
-                        case nrex_class_xdigit:
-                            if (c <= 'F')
-                            {
-                                return true;
-                            }
-                        default:
-                            break;
-                    }
-                }
-                else if ('a' <= c && c <= 'z')
-                {
-                    switch (type)
-                    {
-                        case nrex_class_alnum:
-                        case nrex_class_alpha:
-                        case nrex_class_lower:
-                        case nrex_class_word:
-                            return true;
-                        case nrex_class_xdigit:
-                            if (c <= 'f')
-                            {
-                                return true;
-                            }
-                        default:
-                            break;
-                    }
-                }
+                nrex_char* copy = reinterpret_cast<nrex_char*>(*cursor);
+                memcpy(copy, literal, literal_length * sizeof(nrex_char));
+                *cursor += padded(literal_length * sizeof(nrex_char));
+                NREX_DELETE_ARRAY(literal);
+                literal = copy;
             }
-            switch (c)
+            if (first)
             {
-                case ' ':
-                case '\t':
-                    if (type == nrex_class_blank)
-                    {
-                        return true;
-                    }
-                case '\r':
-                case '\n':
-                case '\f':
-                    if (type == nrex_class_space)
-                    {
-                        return true;
-                    }
-                    break;
-                case '_':
-                    if (type == nrex_class_word)
-                    {
-                        return true;
-                    }
-                case ']':
-                case '[':
-                case '!':
-                case '"':
-                case '#':
-                case '$':
-                case '%':
-                case '&':
-                case '\'':
-                case '(':
-                case ')':
-                case '*':
-                case '+':
-                case ',':
-                case '.':
-                case '/':
-                case ':':
-                case ';':
-                case '<':
-                case '=':
-                case '>':
-                case '?':
-                case '@':
-                case '\\':
-                case '^':
-                case '`':
-                case '{':
-                case '|':
-                case '}':
-                case '~':
-                case '-':
-                    if (type == nrex_class_punct)
-                    {
-                        return true;
-                    }
-                    break;
-                default:
-                    break;
+                nrex_charset* copy = new (*cursor) nrex_charset(*first);
+                *cursor += padded(sizeof(nrex_charset));
+                NREX_DELETE(first);
+                first = copy;
+            }
+            packed = true;
+            if (reverse)
+            {
+                reverse->settle(cursor);
             }
-            return false;
         }
-};
 
-static bool nrex_is_shorthand(nrex_char repr)
-{
-    switch (repr)
-    {
-        case 'W':
-        case 'w':
-        case 'D':
-        case 'd':
-        case 'S':
-        case 's':
-            return true;
-    }
-    return false;
-}
+        // Lays a freshly compiled program and its reverse out in one block,
+        // the way a serialized blob holds them, in place of an allocation
+        // for every array.
+        void pack()
+        {
+            if (borrowed || packed)
+            {
+                return;
+            }
+            unsigned int size = footprint();
+            storage = NREX_NEW_ARRAY(nrex_arena_align, size / sizeof(nrex_arena_align) + 1);
+            char* cursor = reinterpret_cast<char*>(storage);
+            settle(&cursor);
+        }
 
-struct nrex_node_shorthand : public nrex_node
-{
-        nrex_char repr;
+        int emit(int op, int x = 0, int y = 0, int z = 0)
+        {
+            nrex_inst inst;
+            inst.op = op;
+            inst.x = x;
+            inst.y = y;
+            inst.z = z;
+            code.push(inst);
+#ifdef NREX_INSTRUMENT
+            sources.resize(code.size() * 2 - 2);
+            sources.push(source_begin);
+            sources.push(source_end);
+#endif
+            if (code.size() > NREX_PROGRAM_LIMIT)
+            {
+                pike = false;
+            }
+            return code.size() - 1;
+        }
 
-        nrex_node_shorthand(nrex_char c)
-            : nrex_node(true)
-            , repr(c)
+        bool lowering() const
         {
-            length = 1;
+            return pike || backtrack;
+        }
+
+        void set_split(int pc, int body, int exit, bool greedy)
+        {
+            code[pc].x = greedy ? body : exit;
+            code[pc].y = greedy ? exit : body;
         }
 
-        int test(nrex_search* s, int pos) const
+        void write(nrex_writer* w) const
         {
-            if (s->end <= pos || 0 > pos)
+            w->put_int(code.size());
+            w->put_int(items.size());
+            w->put_int(brackets.size());
+            w->put_int(slots);
+            w->put_int(registers);
+            w->put_int(depth);
+            w->put_int(classes);
+            w->put_int(literal_length);
+            w->put_int(literal_offset);
+            w->put_int(anchor_end);
+            w->put_int((pike ? 1 : 0) | (backtrack ? 2 : 0) | (anchor_start ? 4 : 0) | (first ? 8 : 0) | (reverse ? 16 : 0) | (prefixes ? 32 : 0) | (anchored_end ? 64 : 0));
+            w->put(classmap, sizeof(classmap));
+            w->put(&code[0], code.size() * sizeof(nrex_inst));
+            w->put(items.size() ? &items[0] : NULL, items.size() * sizeof(nrex_inst));
+            w->put(brackets.size() ? &brackets[0] : NULL, brackets.size() * sizeof(nrex_bracket));
+            w->put(literal, literal_length * sizeof(nrex_char));
+            if (first)
             {
-                return -1;
+                w->put(first->bits, sizeof(first->bits));
+                w->put_int(first->wide ? 1 : 0);
             }
-            bool found = false;
-            bool invert = false;
-            nrex_char c = s->at(pos);
-            switch (repr)
+            if (prefixes)
             {
-                case '.':
-                    found = true;
-                    break;
-                case 'W':
-                    invert = true;
-                case 'w':
-                    if (c == '_' || NREX_ISALPHANUM(c))
-                    {
-                        found = true;
-                    }
-                    break;
-                case 'D':
-                    invert = true;
-                case 'd':
-                    if ('0' <= c && c <= '9')
-                    {
-                        found = true;
-                    }
-                    break;
-                case 'S':
-                    invert = true;
-                case 's':
-                    if (NREX_ISSPACE(c))
-                    {
-                        found = true;
-                    }
-                    break;
+                w->put_int(prefixes->lengths.size());
+                w->put_int(prefixes->chars.size());
+                w->put(&prefixes->lengths[0], prefixes->lengths.size() * sizeof(int));
+                w->put(&prefixes->chars[0], prefixes->chars.size() * sizeof(nrex_char));
             }
-            if (found == invert)
+            if (reverse)
             {
-                return -1;
+                reverse->write(w);
             }
-            return next ? next->test(s, pos + 1) : pos + 1;
         }
-};
 
-static bool nrex_is_quantifier(nrex_char repr)
-{
-    switch (repr)
-    {
-        case '?':
-        case '*':
-        case '+':
-        case '{':
-            return true;
-    }
-    return false;
-}
-
-struct nrex_node_quantifier : public nrex_node
-{
-        int min;
-        int max;
-        bool greedy;
-        nrex_node* child;
-
-        nrex_node_quantifier(int min, int max)
-            : nrex_node()
-            , min(min)
-            , max(max)
-            , greedy(true)
-            , child(NULL)
+        bool read(nrex_reader* r)
         {
+            int code_size = r->take_int();
+            int item_size = r->take_int();
+            int bracket_size = r->take_int();
+            slots = r->take_int();
+            registers = r->take_int();
+            depth = r->take_int();
+            classes = r->take_int();
+            literal_length = r->take_int();
+            literal_offset = r->take_int();
+            anchor_end = r->take_int();
+            int flags = r->take_int();
+            const void* map = r->take(sizeof(classmap));
+            const void* insts = r->take(code_size, sizeof(nrex_inst));
+            const void* members = r->take(item_size, sizeof(nrex_inst));
+            const void* sets = r->take(bracket_size, sizeof(nrex_bracket));
+            const void* chars = r->take(literal_length, sizeof(nrex_char));
+            if (r->pos < 0)
+            {
+                return false;
+            }
+            memcpy(classmap, map, sizeof(classmap));
+            code.borrow((const nrex_inst*)insts, code_size);
+            items.borrow((const nrex_inst*)members, item_size);
+            brackets.borrow((const nrex_bracket*)sets, bracket_size);
+            borrowed = true;
+            literal = literal_length ? (nrex_char*)chars : NULL;
+            pike = (flags & 1) != 0;
+            backtrack = (flags & 2) != 0;
+            anchor_start = (flags & 4) != 0;
+            anchored_end = (flags & 64) != 0;
+            if (flags & 8)
+            {
+                const void* bits = r->take(sizeof(first->bits));
+                int wide = r->take_int();
+                if (r->pos < 0)
+                {
+                    return false;
+                }
+                first = NREX_NEW(nrex_charset);
+                memcpy(first->bits, bits, sizeof(first->bits));
+                first->wide = (wide != 0);
+                first->prepare();
+            }
+            if ((flags & 32) && !read_prefixes(r))
+            {
+                return false;
+            }
+            if (flags & 16)
+            {
+                reverse = NREX_NEW(nrex_program(0));
+                reverse->backward = true;
+                if (!reverse->read(r) || !reverse->pike)
+                {
+                    return false;
+                }
+            }
+            return check();
         }
 
-        virtual ~nrex_node_quantifier()
+        bool read_prefixes(nrex_reader* r)
         {
-            if (child)
+            int count = r->take_int();
+            int total = r->take_int();
+            const int* lengths = (const int*)r->take(count, sizeof(int));
+            const nrex_char* chars = (const nrex_char*)r->take(total, sizeof(nrex_char));
+            if (r->pos < 0 || count > NREX_PREFIX_COUNT)
+            {
+                return false;
+            }
+            prefixes = NREX_NEW(nrex_literals);
+            for (int i = 0; i < count; ++i)
             {
-                NREX_DELETE(child);
+                if (lengths[i] > total || !prefixes->add(chars, lengths[i]))
+                {
+                    return false;
+                }
+                chars += lengths[i];
+                total -= lengths[i];
             }
+            prefixes->build();
+            return total == 0 && prefixes->useful();
         }
 
-        int test(nrex_search* s, int pos) const
+        bool check_pc(int pc) const
         {
-            return test_step(s, pos, 0, pos);
+            return 0 <= pc && pc < (int)code.size();
         }
 
-        int test_step(nrex_search* s, int pos, int level, int start) const
+        bool check_item(const nrex_inst& inst) const
         {
-            if (pos > s->end)
+            if (inst.op == nrex_op_class)
             {
-                return -1;
+                return nrex_class_none <= inst.x && inst.x <= nrex_class_word;
             }
-            if (!greedy && level > min)
+            return nrex_op_char <= inst.op && inst.op < nrex_op_bracket;
+        }
+
+        bool check() const
+        {
+            int count = code.size();
+            if (count == 0 || code[count - 1].op != nrex_op_match || slots < 2 || depth < 0 || depth > count)
             {
-                int res = pos;
-                if (next)
-                {
-                    res = next->test(s, res);
-                }
-                if (s->complete)
-                {
-                    return res;
-                }
-                if (res >= 0 && parent->test_parent(s, res) >= 0)
-                {
-                    return res;
-                }
+                return false;
             }
-            if (max >= 0 && level > max)
+            if (registers < slots || registers - slots > count * 2)
             {
-                return -1;
+                return false;
             }
-            if (level > 1 && level > min + 1 && pos == start)
+            if (pike == backtrack || ((reverse || backward) && classes == 0))
             {
-                return -1;
+                return false;
+            }
+            if (classes < 0 || classes > 256 || literal_length < 0 || literal_offset < -1 || anchor_end < -1)
+            {
+                return false;
             }
-            int res = pos;
-            if (level >= 1)
+            for (int i = 0; i < 256 && classes > 0; ++i)
             {
-                res = child->test(s, pos);
-                if (s->complete)
+                if (classmap[i] >= classes)
                 {
-                    return res;
+                    return false;
                 }
             }
-            if (res >= 0)
+            for (int pc = 0; pc < count; ++pc)
             {
-                int res_step = test_step(s, res, level + 1, start);
-                if (res_step >= 0)
+                const nrex_inst& inst = code[pc];
+                bool valid = true;
+                switch (inst.op)
+                {
+                    case nrex_op_char:
+                        valid = (inst.z == 0 || (backtrack && 1 < inst.z && inst.z < count - pc));
+                        for (int i = 1; valid && i < inst.z; ++i)
+                        {
+                            valid = (code[pc + i].op == nrex_op_char);
+                        }
+                        break;
+                    case nrex_op_class:
+                        valid = check_item(inst);
+                        break;
+                    case nrex_op_match:
+                    case nrex_op_range:
+                    case nrex_op_shorthand:
+                    case nrex_op_anchor_start:
+                    case nrex_op_anchor_end:
+                    case nrex_op_word_boundary:
+                    case nrex_op_look_end:
+                        break;
+                    case nrex_op_bracket:
+                        valid = (inst.x >= 0 && inst.y >= 0 && inst.x <= (int)items.size() - inst.y);
+                        valid = valid && 0 <= inst.z && inst.z < (int)brackets.size();
+                        valid = valid && 0 <= brackets[inst.z].ranges && brackets[inst.z].ranges <= inst.y;
+                        for (int i = 0; valid && i < inst.y; ++i)
+                        {
+                            valid = check_item(items[inst.x + i]);
+                            valid = valid && (i >= brackets[inst.z].ranges || items[inst.x + i].op == nrex_op_range);
+                        }
+                        break;
+                    case nrex_op_split:
+                        valid = check_pc(inst.x) && check_pc(inst.y) && (pike || (pc < inst.x && pc < inst.y));
+                        break;
+                    case nrex_op_jump:
+                        valid = check_pc(inst.x) && (pike || pc < inst.x);
+                        break;
+                    case nrex_op_save:
+                        valid = (0 <= inst.x && inst.x < (pike ? registers : slots));
+                        break;
+                    case nrex_op_progress:
+                        valid = (pike && slots <= inst.x && inst.x < registers && pc < inst.y && check_pc(inst.y));
+                        break;
+                    case nrex_op_look_ahead:
+                        valid = (pc < inst.y && check_pc(inst.y) && code[inst.y - 1].op == nrex_op_look_end);
+                        break;
+                    case nrex_op_look_behind:
+                    case nrex_op_atomic:
+                        valid = (!pike && pc < inst.y && check_pc(inst.y) && code[inst.y - 1].op == nrex_op_look_end);
+                        valid = valid && inst.z >= 0;
+                        break;
+                    case nrex_op_backreference:
+                        valid = (!pike && 0 <= inst.x && inst.x < slots / 2);
+                        break;
+                    case nrex_op_span:
+                        valid = (!pike && pc + 2 < count && inst.x >= 0 && inst.y >= -1);
+                        valid = valid && nrex_op_char <= code[pc + 1].op && code[pc + 1].op <= nrex_op_bracket;
+                        break;
+                    case nrex_op_repeat_init:
+                        valid = (!pike && slots <= inst.x && inst.x < registers - 1 && pc < inst.y && check_pc(inst.y));
+                        valid = valid && code[inst.y].op == nrex_op_repeat && code[inst.y].y == pc + 1;
+                        break;
+                    case nrex_op_repeat:
+                        valid = (!pike && 0 <= inst.x && inst.x < (int)items.size() && 0 < inst.y && inst.y <= pc);
+                        valid = valid && code[inst.y - 1].op == nrex_op_repeat_init && code[inst.y - 1].y == pc;
+                        if (valid)
+                        {
+                            const nrex_inst& item = items[inst.x];
+                            valid = (item.z == code[inst.y - 1].x && item.x >= 0 && item.y >= -1);
+                        }
+                        break;
+                    default:
+                        valid = false;
+                }
+                if (!valid)
                 {
-                    return res_step;
+                    return false;
                 }
-                else if (greedy && level >= min)
+                if (inst.op == nrex_op_look_ahead)
                 {
-                    if (next)
-                    {
-                        res = next->test(s, res);
-                    }
-                    if (s->complete)
+                    int level = 1;
+                    for (int outer = 0; outer < pc; ++outer)
                     {
-                        return res;
+                        if (code[outer].op == nrex_op_look_ahead && pc < code[outer].y)
+                        {
+                            ++level;
+                        }
                     }
-                    if (res >= 0 && parent->test_parent(s, res) >= 0)
+                    if (level > depth)
                     {
-                        return res;
+                        return false;
                     }
                 }
             }
-            return -1;
+            return check_registers();
         }
 
-        virtual int test_parent(nrex_search* s, int pos) const
+        bool check_registers() const
         {
-            s->complete = false;
-            return pos;
+            int count = registers - slots;
+            bool* used = NREX_NEW_ARRAY(bool, count + 1);
+            for (int i = 0; i <= count; ++i)
+            {
+                used[i] = false;
+            }
+            bool valid = true;
+            for (unsigned int pc = 0; pc < code.size() && valid; ++pc)
+            {
+                if (code[pc].op == nrex_op_repeat_init)
+                {
+                    int reg = code[pc].x - slots;
+                    valid = !used[reg] && !used[reg + 1];
+                    used[reg] = true;
+                    used[reg + 1] = true;
+                }
+            }
+            NREX_DELETE_ARRAY(used);
+            return valid;
         }
-};
 
-struct nrex_node_anchor : public nrex_node
-{
-        bool end;
+        // Whether a match can follow an instruction at a position depends on
+        // nothing else, unless a backreference reads the captures or a loop
+        // counts its iterations. Loops that run at most once, or as often
+        // as they like on a body that cannot be empty, only ever look at
+        // their counter on the repeat instruction itself.
+        bool memoizable() const
+        {
+            for (unsigned int pc = 0; pc < code.size(); ++pc)
+            {
+                const nrex_inst& inst = code[pc];
+                if (inst.op == nrex_op_backreference)
+                {
+                    return false;
+                }
+                if (inst.op == nrex_op_repeat)
+                {
+                    const nrex_inst& item = items[inst.x];
+                    if (item.x > 1 || (item.y >= 0 && item.y != 1) || (item.y < 0 && !(item.op & 2)))
+                    {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
 
-        nrex_node_anchor(bool end)
-            : nrex_node()
-            , end(end)
+        bool combinable() const
         {
-            length = 0;
+            return pike && depth == 0;
         }
 
-        int test(nrex_search* s, int pos) const
+        int append(const nrex_program* member, int id)
         {
-            if (!end && pos != 0)
+            int base = code.size();
+            int item_base = items.size();
+            int bracket_base = brackets.size();
+            for (unsigned int i = 0; i < member->items.size(); ++i)
             {
-                return -1;
+                items.push(member->items[i]);
             }
-            else if (end && pos != s->end)
+            for (unsigned int i = 0; i < member->brackets.size(); ++i)
             {
-                return -1;
+                brackets.push(member->brackets[i]);
+            }
+            for (unsigned int pc = 0; pc < member->code.size(); ++pc)
+            {
+                nrex_inst inst = member->code[pc];
+                switch (inst.op)
+                {
+                    case nrex_op_match:
+                        inst.x = id;
+                        break;
+                    case nrex_op_bracket:
+                        inst.x += item_base;
+                        inst.z += bracket_base;
+                        break;
+                    case nrex_op_split:
+                        inst.x += base;
+                        inst.y += base;
+                        break;
+                    case nrex_op_jump:
+                        inst.x += base;
+                        break;
+                    case nrex_op_save:
+                        if (inst.x < member->slots)
+                        {
+                            inst.op = nrex_op_jump;
+                            inst.x = base + pc + 1;
+                        }
+                        else
+                        {
+                            inst.x += registers - member->slots;
+                        }
+                        break;
+                    case nrex_op_progress:
+                        inst.x += registers - member->slots;
+                        inst.y += base;
+                        break;
+                }
+                code.push(inst);
             }
-            return next ? next->test(s, pos) : pos;
+            registers += member->registers - member->slots;
+            return base;
         }
-};
-
-struct nrex_node_word_boundary : public nrex_node
-{
-        bool inverse;
 
-        nrex_node_word_boundary(bool inverse)
-            : nrex_node()
-            , inverse(inverse)
+        unsigned int digest() const
         {
-            length = 0;
+            const int header[] = { slots, registers, depth, classes, members, int(code.size()), int(items.size()), int(brackets.size()) };
+            unsigned int result = nrex_hash(2166136261u, header, sizeof(header));
+            result = nrex_hash(result, classmap, sizeof(classmap));
+            result = nrex_hash(result, &code[0], code.size() * sizeof(nrex_inst));
+            if (items.size())
+            {
+                result = nrex_hash(result, &items[0], items.size() * sizeof(nrex_inst));
+            }
+            if (brackets.size())
+            {
+                result = nrex_hash(result, &brackets[0], brackets.size() * sizeof(nrex_bracket));
+            }
+            if (reverse)
+            {
+                unsigned int inner = reverse->digest();
+                result = nrex_hash(result, &inner, sizeof(inner));
+            }
+            return result;
         }
 
-        int test(nrex_search* s, int pos) const
+        int candidate(const nrex_char* str, int pos, int end, int* hit) const
         {
-            bool left = false;
-            bool right = false;
-            if (pos != 0)
+            int last = end;
+            if (anchor_start)
+            {
+                last = 0;
+            }
+            if (anchor_end >= 0)
+            {
+                if (last > end - anchor_end)
+                {
+                    last = end - anchor_end;
+                }
+                if (pos < end - anchor_end)
+                {
+                    pos = end - anchor_end;
+                }
+            }
+            if (pos > last)
+            {
+                return -1;
+            }
+            if (prefixes)
+            {
+                pos = prefixes->scan(str, pos, end, first);
+                if (pos < 0)
+                {
+                    return -1;
+                }
+            }
+            else if (first)
             {
-                nrex_char c = s->at(pos - 1);
-                if (c == '_' || NREX_ISALPHANUM(c))
+                pos = first->scan(str, pos, end);
+                if (pos == end)
                 {
-                    left = true;
+                    return -1;
                 }
             }
-            if (pos != s->end)
+            if (literal)
             {
-                nrex_char c = s->at(pos);
-                if (c == '_' || NREX_ISALPHANUM(c))
+                if (literal_offset > end - pos)
+                {
+                    return -1;
+                }
+                int from = pos + (literal_offset >= 0 ? literal_offset : 0);
+                if (*hit < from)
+                {
+                    *hit = nrex_find_literal(str, from, end, literal, literal_length);
+                    if (*hit < 0)
+                    {
+                        return -1;
+                    }
+                }
+                if (literal_offset >= 0)
                 {
-                    right = true;
+                    pos = *hit - literal_offset;
                 }
             }
-            if ((left != right) == inverse)
+            if (pos > last)
             {
                 return -1;
             }
-            return next ? next->test(s, pos) : pos;
+            return pos;
         }
 };
 
-struct nrex_node_backreference : public nrex_node
+#ifndef NREX_ARENA_BLOCK
+#define NREX_ARENA_BLOCK 4096
+#endif
+
+// The nodes of a pattern are bumped out of a few blocks that grow in size
+// and are all freed at once, so parsing allocates little and dropping the
+// tree does not walk it.
+struct nrex_arena
 {
-        int ref;
+        char* block;
+        unsigned int used;
+        unsigned int size;
 
-        nrex_node_backreference(int ref)
-            : nrex_node(true)
-            , ref(ref)
+        nrex_arena()
+            : block(NULL)
+            , used(0)
+            , size(0)
         {
-            length = -1;
         }
 
-        int test(nrex_search* s, int pos) const
+        ~nrex_arena()
         {
-            nrex_result& r = s->captures[ref];
-            for (int i = 0; i < r.length; ++i)
+            while (block)
             {
-                if (pos + i >= s->end)
-                {
-                    return -1;
-                }
-                if (s->at(r.start + i) != s->at(pos + i))
+                char* previous;
+                memcpy(&previous, block, sizeof(previous));
+                NREX_DELETE_ARRAY(block);
+                block = previous;
+            }
+        }
+
+        void* allocate(unsigned int bytes)
+        {
+            const unsigned int align = sizeof(nrex_arena_align);
+            bytes = (bytes + align - 1) / align * align;
+            if (used + bytes > size)
+            {
+                unsigned int grown = size ? size * 2 : NREX_ARENA_BLOCK;
+                if (grown < align + bytes)
                 {
-                    return -1;
+                    grown = align + bytes;
                 }
+                char* previous = block;
+                block = NREX_NEW_ARRAY(char, grown);
+                memcpy(block, &previous, sizeof(previous));
+                used = align;
+                size = grown;
             }
-            return next ? next->test(s, pos + r.length) : pos + r.length;
+            void* result = block + used;
+            used += bytes;
+            return result;
         }
 };
 
-bool nrex_has_lookbehind(nrex_array<nrex_node_group*>& stack)
+struct nrex_node;
+struct nrex_node_quantifier;
+
+// A growable list of nodes kept in the arena. Storage it outgrows is left
+// behind until the arena goes.
+struct nrex_node_list
 {
-    for (unsigned int i = 0; i < stack.size(); i++)
-    {
-        if (stack[i]->type == nrex_group_look_behind)
+        nrex_arena* arena;
+        nrex_node** data;
+        unsigned int count;
+        unsigned int reserved;
+
+        nrex_node_list(nrex_arena* arena)
+            : arena(arena)
+            , data(NULL)
+            , count(0)
+            , reserved(0)
         {
-            return true;
         }
-    }
-    return false;
-}
 
-nrex::nrex()
-    : _capturing(0)
-    , _lookahead_depth(0)
-    , _root(NULL)
-{
-}
+        unsigned int size() const
+        {
+            return count;
+        }
 
-nrex::nrex(const nrex_char* pattern, int captures)
-    : _capturing(0)
-    , _lookahead_depth(0)
-    , _root(NULL)
-{
-    compile(pattern, captures);
-}
+        nrex_node* operator[] (unsigned int i) const
+        {
+            return data[i];
+        }
 
-nrex::~nrex()
-{
-    if (_root)
-    {
-        NREX_DELETE(_root);
-    }
-}
+        nrex_node*& operator[] (unsigned int i)
+        {
+            return data[i];
+        }
 
-bool nrex::valid() const
-{
-    return (_root != NULL);
-}
+        void push(nrex_node* node)
+        {
+            if (count == reserved)
+            {
+                reserved = reserved ? reserved * 2 : 4;
+                nrex_node** grown = (nrex_node**)arena->allocate(reserved * sizeof(nrex_node*));
+                for (unsigned int i = 0; i < count; ++i)
+                {
+                    grown[i] = data[i];
+                }
+                data = grown;
+            }
+            data[count++] = node;
+        }
 
-void nrex::reset()
-{
-    _capturing = 0;
-    _lookahead_depth = 0;
-    if (_root)
-    {
-        NREX_DELETE(_root);
-    }
-    _root = NULL;
-}
+        void pop()
+        {
+            if (count > 0)
+            {
+                --count;
+            }
+        }
 
-int nrex::capture_size() const
-{
-    if (_root)
-    {
-        return _capturing + 1;
-    }
-    return 0;
-}
+        void truncate(unsigned int size)
+        {
+            if (size < count)
+            {
+                count = size;
+            }
+        }
+};
 
-bool nrex::compile(const nrex_char* pattern, int captures)
+struct nrex_node
 {
-    reset();
-    nrex_node_group* root = NREX_NEW(nrex_node_group(nrex_group_capture, _capturing));
-    nrex_array<nrex_node_group*> stack;
-    stack.push(root);
-    unsigned int lookahead_level = 0;
-    _root = root;
+        nrex_node* next;
+        nrex_node* previous;
+        nrex_node* parent;
+        bool quantifiable;
+        int length;
+#ifdef NREX_INSTRUMENT
+        int source_begin;
+        int source_end;
+#endif
 
-    for (const nrex_char* c = pattern; c[0] != '\0'; ++c)
-    {
-        if (c[0] == '(')
+        nrex_node(bool quantify = false)
+            : next(NULL)
+            , previous(NULL)
+            , parent(NULL)
+            , quantifiable(quantify)
+            , length(-1)
         {
-            if (c[1] == '?')
+#ifdef NREX_INSTRUMENT
+            source_begin = -1;
+            source_end = -1;
+#endif
+        }
+
+        static void* operator new(size_t size, nrex_arena* arena)
+        {
+            return arena->allocate(size);
+        }
+
+        static void operator delete(void*, nrex_arena*)
+        {
+        }
+
+        virtual int width() const
+        {
+            return length;
+        }
+
+        int chain_width() const
+        {
+            int total = 0;
+            for (const nrex_node* node = this; node; node = node->next)
             {
-                if (c[2] == ':')
+                int w = node->width();
+                if (w < 0)
                 {
-                    c = &c[2];
-                    nrex_node_group* group = NREX_NEW(nrex_node_group(nrex_group_non_capture));
-                    stack.top()->add_child(group);
-                    stack.push(group);
+                    return -1;
                 }
-                else if (c[2] == '!' || c[2] == '=')
+                total += w;
+            }
+            return total;
+        }
+
+        virtual bool anchored_start() const
+        {
+            return false;
+        }
+
+        virtual bool anchored_end() const
+        {
+            return false;
+        }
+
+        const nrex_node* last() const
+        {
+            const nrex_node* node = this;
+            while (node->next)
+            {
+                node = node->next;
+            }
+            return node;
+        }
+
+        virtual bool literal(nrex_point*) const
+        {
+            return false;
+        }
+
+        // Tells whether the node always matches exactly one character and
+        // sets no captures.
+        virtual bool single() const
+        {
+            return false;
+        }
+
+        virtual nrex_node_quantifier* quantifier()
+        {
+            return NULL;
+        }
+
+        virtual bool first(nrex_charset* set) const
+        {
+            set->fill();
+            return true;
+        }
+
+        // Simplifies the nodes below this one and returns the node that
+        // should take its place, which may be a child or a new node.
+        virtual nrex_node* optimize(nrex_arena*)
+        {
+            return this;
+        }
+
+        static nrex_node* optimize_chain(nrex_node* head, nrex_node* parent, nrex_arena* arena)
+        {
+            nrex_node* first = NULL;
+            nrex_node* previous = NULL;
+            for (nrex_node* node = head; node; )
+            {
+                nrex_node* following = node->next;
+                nrex_node* result = node->optimize(arena);
+                result->parent = parent;
+                result->previous = previous;
+                result->next = NULL;
+                if (previous)
                 {
-                    c = &c[2];
-                    nrex_node_group* group = NREX_NEW(nrex_node_group(nrex_group_look_ahead, lookahead_level++));
-                    group->negate = (c[0] == '!');
-                    stack.top()->add_child(group);
-                    stack.push(group);
-                    if (lookahead_level > _lookahead_depth)
-                    {
-                        _lookahead_depth = lookahead_level;
-                    }
+                    previous->next = result;
                 }
-                else if (c[2] == '<' && (c[3] == '!' || c[3] == '='))
+                else
                 {
-                    c = &c[3];
-                    nrex_node_group* group = NREX_NEW(nrex_node_group(nrex_group_look_behind));
-                    group->negate = (c[0] == '!');
-                    stack.top()->add_child(group);
-                    stack.push(group);
+                    first = result;
                 }
-                else
+                previous = result;
+                node = following;
+            }
+            return first;
+        }
+
+        virtual void lower(nrex_program*) const
+        {
+        }
+
+        // Lowers the node, marking the instructions it emits with the part
+        // of the pattern it was parsed from when NREX_INSTRUMENT is set.
+        void lower_node(nrex_program* p) const
+        {
+#ifdef NREX_INSTRUMENT
+            int begin = p->source_begin;
+            int end = p->source_end;
+            if (source_begin >= 0)
+            {
+                p->source_begin = source_begin;
+                p->source_end = source_end;
+            }
+            lower(p);
+            p->source_begin = begin;
+            p->source_end = end;
+#else
+            lower(p);
+#endif
+        }
+
+        void lower_chain(nrex_program* p) const
+        {
+            if (p->backward)
+            {
+                for (const nrex_node* node = last(); node && p->lowering(); node = node->previous)
                 {
-                    NREX_COMPILE_ERROR("unrecognised qualifier for group");
+                    node->lower_node(p);
                 }
+                return;
             }
-            else if (captures >= 0 && _capturing < captures && _capturing < INT_MAX)
+            for (const nrex_node* node = this; node && p->lowering(); node = node->next)
             {
-                nrex_node_group* group = NREX_NEW(nrex_node_group(nrex_group_capture, ++_capturing));
-                stack.top()->add_child(group);
-                stack.push(group);
+                node->lower_node(p);
             }
-            else
+        }
+
+        virtual bool prefixes(nrex_literals*) const
+        {
+            return false;
+        }
+
+        bool prefixes_chain(nrex_literals* set) const
+        {
+            const nrex_node* node = this;
+            while (node && node->width() == 0)
             {
-                nrex_node_group* group = NREX_NEW(nrex_node_group(nrex_group_non_capture));
-                stack.top()->add_child(group);
-                stack.push(group);
+                node = node->next;
+            }
+            nrex_char run[NREX_PREFIX_LENGTH + 3];
+            int length = 0;
+            nrex_point c;
+            while (node && length < NREX_PREFIX_LENGTH && node->literal(&c))
+            {
+                length += nrex_encode(c, &run[length]);
+                node = node->next;
+            }
+            if (length > NREX_PREFIX_LENGTH)
+            {
+                return false;
+            }
+            if (length > 0)
+            {
+                return set->add(run, length);
             }
+            return node && node->prefixes(set);
         }
-        else if (c[0] == ')')
+
+        bool first_chain(nrex_charset* set) const
         {
-            if (stack.size() > 1)
+            for (const nrex_node* node = this; node; node = node->next)
             {
-                if (stack.top()->type == nrex_group_look_ahead)
+                if (!node->first(set))
                 {
-                    --lookahead_level;
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void increment_length(int amount, bool subtract = false)
+        {
+            if (amount >= 0 && length >= 0)
+            {
+                if (!subtract)
+                {
+                    length += amount;
+                }
+                else
+                {
+                    length -= amount;
                 }
-                stack.pop();
             }
             else
             {
-                NREX_COMPILE_ERROR("unexpected ')'");
+                length = -1;
+            }
+            if (parent)
+            {
+                parent->increment_length(amount, subtract);
             }
         }
-        else if (c[0] == '[')
+};
+
+enum nrex_group_type
+{
+    nrex_group_capture,
+    nrex_group_non_capture,
+    nrex_group_atomic,
+    nrex_group_bracket,
+    nrex_group_look_ahead,
+    nrex_group_look_behind
+};
+
+struct nrex_node_group : public nrex_node
+{
+        nrex_group_type type;
+        int id;
+        bool negate;
+        nrex_node_list childset;
+        nrex_node* back;
+
+        nrex_node_group(nrex_arena* arena, nrex_group_type type, int id = 0)
+            : nrex_node(true)
+            , type(type)
+            , id(id)
+            , negate(false)
+            , childset(arena)
+            , back(NULL)
         {
-            nrex_node_group* group = NREX_NEW(nrex_node_group(nrex_group_bracket));
-            stack.top()->add_child(group);
-            if (c[1] == '^')
+            if (type != nrex_group_bracket)
             {
-                group->negate = true;
-                ++c;
+                length = 0;
             }
-            bool first_child = true;
-            nrex_char previous_child;
-            bool previous_child_single = false;
-            while (true)
+            else
             {
-                group->add_childset();
-                ++c;
-                if (c[0] == '\0')
-                {
-                    NREX_COMPILE_ERROR("unclosed bracket expression '['");
-                }
-                if (c[0] == '[' && c[1] == ':')
+                length = 1;
+            }
+            if (type == nrex_group_look_ahead || type == nrex_group_look_behind)
+            {
+                quantifiable = false;
+            }
+        }
+
+        bool single() const
+        {
+            return type == nrex_group_bracket;
+        }
+
+        nrex_node* optimize(nrex_arena* arena)
+        {
+            if (type == nrex_group_bracket)
+            {
+                return this;
+            }
+            for (unsigned int i = 0; i < childset.size(); ++i)
+            {
+                childset[i] = optimize_chain(childset[i], this, arena);
+            }
+            factor_prefixes(arena);
+            merge_characters(arena);
+            if (type == nrex_group_non_capture && childset.size() == 1 && !childset[0]->next)
+            {
+                return childset[0];
+            }
+            return this;
+        }
+
+        // Turns neighbouring alternatives that start with the same
+        // character, such as `ab|ac`, into `a(?:b|c)`.
+        void factor_prefixes(nrex_arena* arena)
+        {
+            unsigned int kept = 0;
+            for (unsigned int i = 0; i < childset.size(); )
+            {
+                nrex_node* head = childset[i];
+                nrex_point c = 0;
+                nrex_point d = 0;
+                unsigned int j = i + 1;
+                if (head->next && head->literal(&c))
                 {
-                    const nrex_char* d = &c[2];
-                    nrex_class_type cls = nrex_parse_class(&d);
-                    if (cls != nrex_class_none)
+                    while (j < childset.size() && childset[j]->next && childset[j]->literal(&d) && d == c)
                     {
-                        c = d;
-                        group->add_child(NREX_NEW(nrex_node_class(cls)));
-                        previous_child_single = false;
+                        ++j;
                     }
-                    else
+                }
+                if (j - i > 1)
+                {
+                    nrex_node_group* rest = new (arena) nrex_node_group(arena, nrex_group_non_capture);
+                    for (unsigned int k = i; k < j; ++k)
                     {
-                        group->add_child(NREX_NEW(nrex_node_char('[')));
-                        previous_child = '[';
-                        previous_child_single = true;
+                        rest->add_childset();
+                        for (nrex_node* node = childset[k]->next; node; )
+                        {
+                            nrex_node* following = node->next;
+                            node->next = NULL;
+                            rest->add_child(node);
+                            node = following;
+                        }
                     }
+                    nrex_node* tail = rest->optimize(arena);
+                    tail->parent = this;
+                    tail->previous = head;
+                    tail->next = NULL;
+                    head->next = tail;
                 }
-                else if (c[0] == ']' && !first_child)
+                childset[kept++] = head;
+                i = j;
+            }
+            childset.truncate(kept);
+        }
+
+        // Turns neighbouring alternatives of a single character, such as
+        // `a|b|c`, into the bracket `[abc]`.
+        void merge_characters(nrex_arena* arena)
+        {
+            unsigned int kept = 0;
+            for (unsigned int i = 0; i < childset.size(); )
+            {
+                nrex_point c;
+                unsigned int j = i;
+                while (j < childset.size() && !childset[j]->next && childset[j]->literal(&c))
                 {
-                    break;
+                    ++j;
                 }
-                else if (c[0] == '\\')
+                if (j - i < 2)
                 {
-                    if (nrex_is_shorthand(c[1]))
-                    {
-                        group->add_child(NREX_NEW(nrex_node_shorthand(c[1])));
-                        ++c;
-                        previous_child_single = false;
-                    }
-                    else
+                    childset[kept++] = childset[i++];
+                    continue;
+                }
+                nrex_node_group* bracket = new (arena) nrex_node_group(arena, nrex_group_bracket);
+                for (; i < j; ++i)
+                {
+                    bracket->add_childset();
+                    bracket->add_child(childset[i]);
+                }
+                bracket->parent = this;
+                childset[kept++] = bracket;
+            }
+            childset.truncate(kept);
+        }
+
+        int width() const
+        {
+            if (type == nrex_group_look_ahead || type == nrex_group_look_behind)
+            {
+                return 0;
+            }
+            if (type == nrex_group_bracket)
+            {
+#ifdef NREX_UTF8
+                for (unsigned int i = 0; i < childset.size(); ++i)
+                {
+                    if (negate || childset[i]->width() != childset[0]->width())
                     {
-                        const nrex_char* d = c;
-                        nrex_char unescaped = nrex_unescape(d);
-                        if (c == d)
-                        {
-                            NREX_COMPILE_ERROR("invalid escape token");
-                        }
-                        group->add_child(NREX_NEW(nrex_node_char(unescaped)));
-                        c = d;
-                        previous_child = unescaped;
-                        previous_child_single = true;
+                        return -1;
                     }
                 }
-                else if (previous_child_single && c[0] == '-')
+                return childset.size() > 0 ? childset[0]->width() : -1;
+#else
+                return 1;
+#endif
+            }
+            int result = 0;
+            for (unsigned int i = 0; i < childset.size(); ++i)
+            {
+                int w = childset[i]->chain_width();
+                if (w < 0 || (i > 0 && w != result))
                 {
-                    bool is_range = false;
-                    nrex_char next;
-                    if (c[1] != '\0' && c[1] != ']')
-                    {
-                        if (c[1] == '\\')
-                        {
-                            const nrex_char* d = ++c;
-                            next = nrex_unescape(d);
-                            if (c == d)
-                            {
-                                NREX_COMPILE_ERROR("invalid escape token in range");
-                            }
-                        }
-                        else
-                        {
-                            next = c[1];
-                            ++c;
-                        }
-                        is_range = true;
-                    }
-                    if (is_range)
-                    {
-                        if (next < previous_child)
-                        {
-                            NREX_COMPILE_ERROR("text range out of order");
-                        }
-                        group->pop_back();
-                        group->add_child(NREX_NEW(nrex_node_range(previous_child, next)));
-                        previous_child_single = false;
-                    }
-                    else
-                    {
-                        group->add_child(NREX_NEW(nrex_node_char(c[0])));
-                        previous_child = c[0];
-                        previous_child_single = true;
-                    }
-                }
-                else
-                {
-                    group->add_child(NREX_NEW(nrex_node_char(c[0])));
-                    previous_child = c[0];
-                    previous_child_single = true;
+                    return -1;
                 }
-                first_child = false;
+                result = w;
             }
+            return result;
         }
-        else if (nrex_is_quantifier(c[0]))
+
+        void lower(nrex_program* p) const
         {
-            int min = 0;
-            int max = -1;
-            bool valid_quantifier = true;
-            if (c[0] == '?')
-            {
-                min = 0;
-                max = 1;
-            }
-            else if (c[0] == '+')
+            if (type == nrex_group_bracket)
             {
-                min = 1;
-                max = -1;
+                int index = p->items.size();
+                for (unsigned int i = 0; i < childset.size(); ++i)
+                {
+                    childset[i]->lower(p);
+                    p->items.push(p->code[p->code.size() - 1]);
+                    p->code.pop();
+                }
+                p->emit(nrex_op_bracket, index, childset.size(), negate);
+                return;
             }
-            else if (c[0] == '*')
+            if (type == nrex_group_capture)
             {
-                min = 0;
-                max = -1;
+                p->emit(nrex_op_save, id * 2);
             }
-            else if (c[0] == '{')
+            int look = -1;
+            if (type == nrex_group_look_ahead)
             {
-                bool max_set = false;
-                const nrex_char* d = c;
-                while (true)
-                {
-                    ++d;
-                    if (d[0] == '\0')
-                    {
-                        valid_quantifier = false;
-                        break;
-                    }
-                    else if (d[0] == '}')
-                    {
-                        break;
-                    }
-                    else if (d[0] == ',')
-                    {
-                        max_set = true;
-                        continue;
-                    }
-                    else if (d[0] < '0' || '9' < d[0])
-                    {
-                        valid_quantifier = false;
-                        break;
-                    }
-                    if (max_set)
-                    {
-                        if (max < 0)
-                        {
-                            max = int(d[0] - '0');
-                        }
-                        else
-                        {
-                            max = max * 10 + int(d[0] - '0');
-                        }
-                    }
-                    else
-                    {
-                        min = min * 10 + int(d[0] - '0');
-                    }
-                }
-                if (!max_set)
-                {
-                    max = min;
-                }
-                if (valid_quantifier)
+                look = p->emit(nrex_op_look_ahead, negate);
+                if (++p->level > p->depth)
                 {
-                    c = d;
+                    p->depth = p->level;
                 }
             }
-            if (valid_quantifier)
+            else if (type == nrex_group_look_behind)
             {
-                if (stack.top()->back == NULL || !stack.top()->back->quantifiable)
-                {
-                    NREX_COMPILE_ERROR("element not quantifiable");
-                }
-                nrex_node_quantifier* quant = NREX_NEW(nrex_node_quantifier(min, max));
-                if (min == max)
+                look = p->emit(nrex_op_look_behind, negate, 0, length);
+                p->pike = false;
+            }
+            else if (type == nrex_group_atomic)
+            {
+                look = p->emit(nrex_op_atomic);
+                p->pike = false;
+            }
+            int jumps = -1;
+            for (unsigned int i = 0; i < childset.size() && p->lowering(); ++i)
+            {
+                int split = -1;
+                if (i + 1 < childset.size())
                 {
-                    if (stack.top()->back->length >= 0)
-                    {
-                        quant->length = max * stack.top()->back->length;
-                    }
+                    split = p->emit(nrex_op_split, p->code.size() + 1);
                 }
-                else
+                childset[i]->lower_chain(p);
+                if (split >= 0)
                 {
-                    if (nrex_has_lookbehind(stack))
-                    {
-                        NREX_COMPILE_ERROR("variable length quantifiers inside lookbehind not supported");
-                    }
+                    jumps = p->emit(nrex_op_jump, jumps);
+                    p->code[split].y = p->code.size();
                 }
-                quant->child = stack.top()->swap_back(quant);
-                quant->child->previous = NULL;
-                quant->child->next = NULL;
-                quant->child->parent = quant;
-                if (c[1] == '?')
+            }
+            while (jumps >= 0)
+            {
+                int pending = p->code[jumps].x;
+                p->code[jumps].x = p->code.size();
+                jumps = pending;
+            }
+            if (look >= 0)
+            {
+                p->emit(nrex_op_look_end);
+                p->code[look].y = p->code.size();
+                if (type == nrex_group_look_ahead)
                 {
-                    quant->greedy = false;
-                    ++c;
+                    --p->level;
                 }
             }
-            else
+            if (type == nrex_group_capture)
             {
-                stack.top()->add_child(NREX_NEW(nrex_node_char(c[0])));
+                p->emit(nrex_op_save, id * 2 + 1);
             }
         }
-        else if (c[0] == '|')
+
+        bool anchored_start() const
         {
-            if (nrex_has_lookbehind(stack))
+            if (type != nrex_group_capture && type != nrex_group_non_capture && type != nrex_group_atomic)
             {
-                NREX_COMPILE_ERROR("alternations inside lookbehind not supported");
+                return false;
             }
-            stack.top()->add_childset();
-        }
-        else if (c[0] == '^' || c[0] == '$')
-        {
-            stack.top()->add_child(NREX_NEW(nrex_node_anchor((c[0] == '$'))));
-        }
-        else if (c[0] == '.')
-        {
-            stack.top()->add_child(NREX_NEW(nrex_node_shorthand('.')));
+            for (unsigned int i = 0; i < childset.size(); ++i)
+            {
+                if (!childset[i]->anchored_start())
+                {
+                    return false;
+                }
+            }
+            return childset.size() > 0;
         }
-        else if (c[0] == '\\')
+
+        bool anchored_end() const
         {
-            if (nrex_is_shorthand(c[1]))
+            if (type != nrex_group_capture && type != nrex_group_non_capture && type != nrex_group_atomic)
             {
-                stack.top()->add_child(NREX_NEW(nrex_node_shorthand(c[1])));
-                ++c;
+                return false;
             }
-            else if (('1' <= c[1] && c[1] <= '9') || (c[1] == 'g' && c[2] == '{'))
+            for (unsigned int i = 0; i < childset.size(); ++i)
             {
-                int ref = 0;
-                bool unclosed = false;
-                if (c[1] == 'g')
-                {
-                    unclosed = true;
-                    c = &c[2];
-                }
-                while ('0' <= c[1] && c[1] <= '9')
+                if (!childset[i]->last()->anchored_end())
                 {
-                    ref = ref * 10 + int(c[1] - '0');
-                    ++c;
+                    return false;
                 }
-                if (c[1] == '}')
+            }
+            return childset.size() > 0;
+        }
+
+        bool first(nrex_charset* set) const
+        {
+            if (type == nrex_group_look_ahead || type == nrex_group_look_behind)
+            {
+                return true;
+            }
+            if (type == nrex_group_bracket)
+            {
+                nrex_charset members;
+                for (unsigned int i = 0; i < childset.size(); ++i)
                 {
-                    unclosed = false;
-                    ++c;
+                    childset[i]->first(&members);
                 }
-                if (ref > _capturing || ref <= 0 || unclosed)
+                if (negate)
                 {
-                    NREX_COMPILE_ERROR("backreference to non-existent capture");
+                    members.invert();
                 }
-                if (nrex_has_lookbehind(stack))
+                set->merge(members);
+                return false;
+            }
+            bool nullable = (childset.size() == 0);
+            for (unsigned int i = 0; i < childset.size(); ++i)
+            {
+                if (childset[i]->first_chain(set))
                 {
-                    NREX_COMPILE_ERROR("backreferences inside lookbehind not supported");
+                    nullable = true;
                 }
-                stack.top()->add_child(NREX_NEW(nrex_node_backreference(ref)));
             }
-            else if (c[1] == 'b' || c[1] == 'B')
+            return nullable;
+        }
+
+        bool prefixes(nrex_literals* set) const
+        {
+            if (type != nrex_group_capture && type != nrex_group_non_capture && type != nrex_group_atomic)
             {
-                stack.top()->add_child(NREX_NEW(nrex_node_word_boundary(c[1] == 'B')));
-                ++c;
+                return false;
             }
-            else
+            for (unsigned int i = 0; i < childset.size(); ++i)
             {
-                const nrex_char* d = c;
-                nrex_char unescaped = nrex_unescape(d);
-                if (c == d)
+                if (!childset[i]->prefixes_chain(set))
                 {
-                    NREX_COMPILE_ERROR("invalid escape token");
+                    return false;
                 }
-                stack.top()->add_child(NREX_NEW(nrex_node_char(unescaped)));
-                c = d;
             }
+            return childset.size() > 0;
         }
-        else
+
+        void add_childset()
         {
-            stack.top()->add_child(NREX_NEW(nrex_node_char(c[0])));
+            if (childset.size() > 0 && type != nrex_group_bracket)
+            {
+                length = -1;
+            }
+            back = NULL;
         }
-    }
-    if (stack.size() > 1)
-    {
-        NREX_COMPILE_ERROR("unclosed group '('");
-    }
-    return true;
-}
 
-bool nrex::match(const nrex_char* str, nrex_result* captures, int offset, int end) const
-{
-    if (!_root)
-    {
-        return false;
-    }
-    nrex_search s(str, captures, _lookahead_depth);
-    if (end >= offset)
-    {
-        s.end = end;
-    }
-    else
-    {
-        s.end = NREX_STRLEN(str);
-    }
-    for (int i = offset; i <= s.end; ++i)
-    {
-        for (int c = 0; c <= _capturing; ++c)
+        void add_child(nrex_node* node)
         {
-            captures[c].start = 0;
-            captures[c].length = 0;
+            node->parent = this;
+            node->previous = back;
+            if (back && type != nrex_group_bracket)
+            {
+                back->next = node;
+            }
+            else
+            {
+                childset.push(node);
+            }
+            if (type != nrex_group_bracket)
+            {
+                increment_length(node->length);
+            }
+            back = node;
         }
-        if (_root->test(&s, i) >= 0)
+
+        nrex_node* swap_back(nrex_node* node)
         {
-            return true;
-        }
-    }
-    return false;
+            if (!back)
+            {
+                add_child(node);
+                return NULL;
+            }
+            nrex_node* old = back;
+            if (!old->previous)
+            {
+                childset.pop();
+            }
+            if (type != nrex_group_bracket)
+            {
+                increment_length(old->length, true);
+            }
+            back = old->previous;
+            add_child(node);
+            return old;
+        }
+
+        void pop_back()
+        {
+            if (back)
+            {
+                nrex_node* old = back;
+                if (!old->previous)
+                {
+                    childset.pop();
+                }
+                if (type != nrex_group_bracket)
+                {
+                    increment_length(old->length, true);
+                }
+                back = old->previous;
+            }
+        }
+};
+
+struct nrex_node_char : public nrex_node
+{
+        nrex_point ch;
+
+        nrex_node_char(nrex_point c)
+            : nrex_node(true)
+            , ch(c)
+        {
+            length = 1;
+        }
+
+        int width() const
+        {
+            nrex_char bytes[4];
+            return nrex_encode(ch, bytes);
+        }
+
+        bool literal(nrex_point* c) const
+        {
+            *c = ch;
+            return true;
+        }
+
+        bool single() const
+        {
+            return true;
+        }
+
+        bool first(nrex_charset* set) const
+        {
+            set->add(ch);
+            return false;
+        }
+
+        void lower(nrex_program* p) const
+        {
+            p->emit(nrex_op_char, ch);
+        }
+};
+
+struct nrex_node_range : public nrex_node
+{
+        nrex_point start;
+        nrex_point end;
+
+        nrex_node_range(nrex_point s, nrex_point e)
+            : nrex_node(true)
+            , start(s)
+            , end(e)
+        {
+            length = 1;
+        }
+
+        int width() const
+        {
+            nrex_char bytes[4];
+            int w = nrex_encode(start, bytes);
+            return (w == nrex_encode(end, bytes)) ? w : -1;
+        }
+
+        bool first(nrex_charset* set) const
+        {
+            for (int i = 0; i <= 0xFF; ++i)
+            {
+                nrex_point c = nrex_point(i);
+                if (start <= c && c <= end)
+                {
+                    set->add(c);
+                }
+            }
+            if (sizeof(nrex_point) > 1 && 0xFF < (unsigned int)end)
+            {
+                set->widen();
+            }
+            return false;
+        }
+
+        void lower(nrex_program* p) const
+        {
+            p->emit(nrex_op_range, start, end);
+        }
+};
+
+static bool nrex_compare_class(const nrex_char** pos, const char* text)
+{
+    unsigned int i = 0;
+    for (i = 0; text[i] != '\0'; ++i)
+    {
+        if ((*pos)[i] != text[i])
+        {
+            return false;
+        }
+    }
+    if ((*pos)[i++] != ':' || (*pos)[i] != ']')
+    {
+        return false;
+    }
+    *pos = &(*pos)[i];
+    return true;
+}
+
+#define NREX_COMPARE_CLASS(POS, NAME) if (nrex_compare_class(POS, #NAME)) return nrex_class_ ## NAME
+
+static nrex_class_type nrex_parse_class(const nrex_char** pos)
+{
+    NREX_COMPARE_CLASS(pos, alnum);
+    NREX_COMPARE_CLASS(pos, alpha);
+    NREX_COMPARE_CLASS(pos, blank);
+    NREX_COMPARE_CLASS(pos, cntrl);
+    NREX_COMPARE_CLASS(pos, digit);
+    NREX_COMPARE_CLASS(pos, graph);
+    NREX_COMPARE_CLASS(pos, lower);
+    NREX_COMPARE_CLASS(pos, print);
+    NREX_COMPARE_CLASS(pos, punct);
+    NREX_COMPARE_CLASS(pos, space);
+    NREX_COMPARE_CLASS(pos, upper);
+    NREX_COMPARE_CLASS(pos, xdigit);
+    NREX_COMPARE_CLASS(pos, word);
+    return nrex_class_none;
+}
+
+#define NREX_CLASS(NAME) (1 << nrex_class_ ## NAME)
+#define NREX_C NREX_CLASS(cntrl)
+#define NREX_S (NREX_CLASS(cntrl) | NREX_CLASS(space))
+#define NREX_T (NREX_CLASS(cntrl) | NREX_CLASS(space) | NREX_CLASS(blank))
+#define NREX_B (NREX_CLASS(print) | NREX_CLASS(space) | NREX_CLASS(blank))
+#define NREX_P (NREX_CLASS(print) | NREX_CLASS(graph) | NREX_CLASS(punct))
+#define NREX_W (NREX_P | NREX_CLASS(word))
+#define NREX_D (NREX_CLASS(print) | NREX_CLASS(graph) | NREX_CLASS(alnum) | NREX_CLASS(word) | NREX_CLASS(digit) | NREX_CLASS(xdigit))
+#define NREX_U (NREX_CLASS(print) | NREX_CLASS(graph) | NREX_CLASS(alnum) | NREX_CLASS(word) | NREX_CLASS(alpha) | NREX_CLASS(upper))
+#define NREX_L (NREX_CLASS(print) | NREX_CLASS(graph) | NREX_CLASS(alnum) | NREX_CLASS(word) | NREX_CLASS(alpha) | NREX_CLASS(lower))
+#define NREX_X (NREX_U | NREX_CLASS(xdigit))
+#define NREX_Y (NREX_L | NREX_CLASS(xdigit))
+
+// The classes of each ASCII character, one bit per nrex_class_type. They
+// are fixed here instead of asking the C library so that matching does not
+// depend on the process locale.
+static const unsigned short nrex_ascii_classes[128] = {
+    NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_T, NREX_S, NREX_S, NREX_S, NREX_S, NREX_C, NREX_C,
+    NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_C, NREX_C,
+    NREX_B, NREX_P, NREX_P, NREX_P, NREX_P, NREX_P, NREX_P, NREX_P, NREX_P, NREX_P, NREX_P, NREX_P, NREX_P, NREX_P, NREX_P, NREX_P,
+    NREX_D, NREX_D, NREX_D, NREX_D, NREX_D, NREX_D, NREX_D, NREX_D, NREX_D, NREX_D, NREX_P, NREX_P, NREX_P, NREX_P, NREX_P, NREX_P,
+    NREX_P, NREX_X, NREX_X, NREX_X, NREX_X, NREX_X, NREX_X, NREX_U, NREX_U, NREX_U, NREX_U, NREX_U, NREX_U, NREX_U, NREX_U, NREX_U,
+    NREX_U, NREX_U, NREX_U, NREX_U, NREX_U, NREX_U, NREX_U, NREX_U, NREX_U, NREX_U, NREX_U, NREX_P, NREX_P, NREX_P, NREX_P, NREX_W,
+    NREX_P, NREX_Y, NREX_Y, NREX_Y, NREX_Y, NREX_Y, NREX_Y, NREX_L, NREX_L, NREX_L, NREX_L, NREX_L, NREX_L, NREX_L, NREX_L, NREX_L,
+    NREX_L, NREX_L, NREX_L, NREX_L, NREX_L, NREX_L, NREX_L, NREX_L, NREX_L, NREX_L, NREX_L, NREX_P, NREX_P, NREX_P, NREX_P, NREX_C,
+};
+
+#undef NREX_C
+#undef NREX_S
+#undef NREX_T
+#undef NREX_B
+#undef NREX_P
+#undef NREX_W
+#undef NREX_D
+#undef NREX_U
+#undef NREX_L
+#undef NREX_X
+#undef NREX_Y
+
+static bool nrex_test_class(nrex_class_type type, nrex_point c)
+{
+    return (unsigned int)c < 0x80 && (nrex_ascii_classes[(unsigned int)c] & (1 << type)) != 0;
+}
+
+#if defined(NREX_UNICODE) || defined(NREX_UTF8)
+// Wide characters above ASCII that count towards \w, as sorted ranges of
+// Unicode letters and numbers.
+static const int nrex_unicode_word[][2] = {
+    { 0xAA, 0xAA }, { 0xB2, 0xB3 }, { 0xB5, 0xB5 }, { 0xB9, 0xBA }, { 0xBC, 0xBE },
+    { 0xC0, 0xD6 }, { 0xD8, 0xF6 }, { 0xF8, 0x2C1 }, { 0x2C6, 0x2D1 }, { 0x2E0, 0x2E4 },
+    { 0x2EC, 0x2EC }, { 0x2EE, 0x2EE }, { 0x370, 0x374 }, { 0x376, 0x377 }, { 0x37A, 0x37D },
+    { 0x37F, 0x37F }, { 0x386, 0x386 }, { 0x388, 0x38A }, { 0x38C, 0x38C }, { 0x38E, 0x3A1 },
+    { 0x3A3, 0x3F5 }, { 0x3F7, 0x481 }, { 0x48A, 0x52F }, { 0x531, 0x556 }, { 0x559, 0x559 },
+    { 0x560, 0x588 }, { 0x5D0, 0x5EA }, { 0x5EF, 0x5F2 }, { 0x620, 0x64A }, { 0x660, 0x669 },
+    { 0x66E, 0x66F }, { 0x671, 0x6D3 }, { 0x6D5, 0x6D5 }, { 0x6E5, 0x6E6 }, { 0x6EE, 0x6FC },
+    { 0x6FF, 0x6FF }, { 0x710, 0x710 }, { 0x712, 0x72F }, { 0x74D, 0x7A5 }, { 0x7B1, 0x7B1 },
+    { 0x7C0, 0x7EA }, { 0x7F4, 0x7F5 }, { 0x7FA, 0x7FA }, { 0x800, 0x815 }, { 0x81A, 0x81A },
+    { 0x824, 0x824 }, { 0x828, 0x828 }, { 0x840, 0x858 }, { 0x860, 0x86A }, { 0x870, 0x887 },
+    { 0x889, 0x88E }, { 0x8A0, 0x8C9 }, { 0x904, 0x939 }, { 0x93D, 0x93D }, { 0x950, 0x950 },
+    { 0x958, 0x961 }, { 0x966, 0x96F }, { 0x971, 0x980 }, { 0x985, 0x98C }, { 0x98F, 0x990 },
+    { 0x993, 0x9A8 }, { 0x9AA, 0x9B0 }, { 0x9B2, 0x9B2 }, { 0x9B6, 0x9B9 }, { 0x9BD, 0x9BD },
+    { 0x9CE, 0x9CE }, { 0x9DC, 0x9DD }, { 0x9DF, 0x9E1 }, { 0x9E6, 0x9F1 }, { 0x9F4, 0x9F9 },
+    { 0x9FC, 0x9FC }, { 0xA05, 0xA0A }, { 0xA0F, 0xA10 }, { 0xA13, 0xA28 }, { 0xA2A, 0xA30 },
+    { 0xA32, 0xA33 }, { 0xA35, 0xA36 }, { 0xA38, 0xA39 }, { 0xA59, 0xA5C }, { 0xA5E, 0xA5E },
+    { 0xA66, 0xA6F }, { 0xA72, 0xA74 }, { 0xA85, 0xA8D }, { 0xA8F, 0xA91 }, { 0xA93, 0xAA8 },
+    { 0xAAA, 0xAB0 }, { 0xAB2, 0xAB3 }, { 0xAB5, 0xAB9 }, { 0xABD, 0xABD }, { 0xAD0, 0xAD0 },
+    { 0xAE0, 0xAE1 }, { 0xAE6, 0xAEF }, { 0xAF9, 0xAF9 }, { 0xB05, 0xB0C }, { 0xB0F, 0xB10 },
+    { 0xB13, 0xB28 }, { 0xB2A, 0xB30 }, { 0xB32, 0xB33 }, { 0xB35, 0xB39 }, { 0xB3D, 0xB3D },
+    { 0xB5C, 0xB5D }, { 0xB5F, 0xB61 }, { 0xB66, 0xB6F }, { 0xB71, 0xB77 }, { 0xB83, 0xB83 },
+    { 0xB85, 0xB8A }, { 0xB8E, 0xB90 }, { 0xB92, 0xB95 }, { 0xB99, 0xB9A }, { 0xB9C, 0xB9C },
+    { 0xB9E, 0xB9F }, { 0xBA3, 0xBA4 }, { 0xBA8, 0xBAA }, { 0xBAE, 0xBB9 }, { 0xBD0, 0xBD0 },
+    { 0xBE6, 0xBF2 }, { 0xC05, 0xC0C }, { 0xC0E, 0xC10 }, { 0xC12, 0xC28 }, { 0xC2A, 0xC39 },
+    { 0xC3D, 0xC3D }, { 0xC58, 0xC5A }, { 0xC5D, 0xC5D }, { 0xC60, 0xC61 }, { 0xC66, 0xC6F },
+    { 0xC78, 0xC7E }, { 0xC80, 0xC80 }, { 0xC85, 0xC8C }, { 0xC8E, 0xC90 }, { 0xC92, 0xCA8 },
+    { 0xCAA, 0xCB3 }, { 0xCB5, 0xCB9 }, { 0xCBD, 0xCBD }, { 0xCDD, 0xCDE }, { 0xCE0, 0xCE1 },
+    { 0xCE6, 0xCEF }, { 0xCF1, 0xCF2 }, { 0xD04, 0xD0C }, { 0xD0E, 0xD10 }, { 0xD12, 0xD3A },
+    { 0xD3D, 0xD3D }, { 0xD4E, 0xD4E }, { 0xD54, 0xD56 }, { 0xD58, 0xD61 }, { 0xD66, 0xD78 },
+    { 0xD7A, 0xD7F }, { 0xD85, 0xD96 }, { 0xD9A, 0xDB1 }, { 0xDB3, 0xDBB }, { 0xDBD, 0xDBD },
+    { 0xDC0, 0xDC6 }, { 0xDE6, 0xDEF }, { 0xE01, 0xE30 }, { 0xE32, 0xE33 }, { 0xE40, 0xE46 },
+    { 0xE50, 0xE59 }, { 0xE81, 0xE82 }, { 0xE84, 0xE84 }, { 0xE86, 0xE8A }, { 0xE8C, 0xEA3 },
+    { 0xEA5, 0xEA5 }, { 0xEA7, 0xEB0 }, { 0xEB2, 0xEB3 }, { 0xEBD, 0xEBD }, { 0xEC0, 0xEC4 },
+    { 0xEC6, 0xEC6 }, { 0xED0, 0xED9 }, { 0xEDC, 0xEDF }, { 0xF00, 0xF00 }, { 0xF20, 0xF33 },
+    { 0xF40, 0xF47 }, { 0xF49, 0xF6C }, { 0xF88, 0xF8C }, { 0x1000, 0x102A }, { 0x103F, 0x1049 },
+    { 0x1050, 0x1055 }, { 0x105A, 0x105D }, { 0x1061, 0x1061 }, { 0x1065, 0x1066 }, { 0x106E, 0x1070 },
+    { 0x1075, 0x1081 }, { 0x108E, 0x108E }, { 0x1090, 0x1099 }, { 0x10A0, 0x10C5 }, { 0x10C7, 0x10C7 },
+    { 0x10CD, 0x10CD }, { 0x10D0, 0x10FA }, { 0x10FC, 0x1248 }, { 0x124A, 0x124D }, { 0x1250, 0x1256 },
+    { 0x1258, 0x1258 }, { 0x125A, 0x125D }, { 0x1260, 0x1288 }, { 0x128A, 0x128D }, { 0x1290, 0x12B0 },
+    { 0x12B2, 0x12B5 }, { 0x12B8, 0x12BE }, { 0x12C0, 0x12C0 }, { 0x12C2, 0x12C5 }, { 0x12C8, 0x12D6 },
+    { 0x12D8, 0x1310 }, { 0x1312, 0x1315 }, { 0x1318, 0x135A }, { 0x1369, 0x137C }, { 0x1380, 0x138F },
+    { 0x13A0, 0x13F5 }, { 0x13F8, 0x13FD }, { 0x1401, 0x166C }, { 0x166F, 0x167F }, { 0x1681, 0x169A },
+    { 0x16A0, 0x16EA }, { 0x16EE, 0x16F8 }, { 0x1700, 0x1711 }, { 0x171F, 0x1731 }, { 0x1740, 0x1751 },
+    { 0x1760, 0x176C }, { 0x176E, 0x1770 }, { 0x1780, 0x17B3 }, { 0x17D7, 0x17D7 }, { 0x17DC, 0x17DC },
+    { 0x17E0, 0x17E9 }, { 0x17F0, 0x17F9 }, { 0x1810, 0x1819 }, { 0x1820, 0x1878 }, { 0x1880, 0x1884 },
+    { 0x1887, 0x18A8 }, { 0x18AA, 0x18AA }, { 0x18B0, 0x18F5 }, { 0x1900, 0x191E }, { 0x1946, 0x196D },
+    { 0x1970, 0x1974 }, { 0x1980, 0x19AB }, { 0x19B0, 0x19C9 }, { 0x19D0, 0x19DA }, { 0x1A00, 0x1A16 },
+    { 0x1A20, 0x1A54 }, { 0x1A80, 0x1A89 }, { 0x1A90, 0x1A99 }, { 0x1AA7, 0x1AA7 }, { 0x1B05, 0x1B33 },
+    { 0x1B45, 0x1B4C }, { 0x1B50, 0x1B59 }, { 0x1B83, 0x1BA0 }, { 0x1BAE, 0x1BE5 }, { 0x1C00, 0x1C23 },
+    { 0x1C40, 0x1C49 }, { 0x1C4D, 0x1C7D }, { 0x1C80, 0x1C88 }, { 0x1C90, 0x1CBA }, { 0x1CBD, 0x1CBF },
+    { 0x1CE9, 0x1CEC }, { 0x1CEE, 0x1CF3 }, { 0x1CF5, 0x1CF6 }, { 0x1CFA, 0x1CFA }, { 0x1D00, 0x1DBF },
+    { 0x1E00, 0x1F15 }, { 0x1F18, 0x1F1D }, { 0x1F20, 0x1F45 }, { 0x1F48, 0x1F4D }, { 0x1F50, 0x1F57 },
+    { 0x1F59, 0x1F59 }, { 0x1F5B, 0x1F5B }, { 0x1F5D, 0x1F5D }, { 0x1F5F, 0x1F7D }, { 0x1F80, 0x1FB4 },
+    { 0x1FB6, 0x1FBC }, { 0x1FBE, 0x1FBE }, { 0x1FC2, 0x1FC4 }, { 0x1FC6, 0x1FCC }, { 0x1FD0, 0x1FD3 },
+    { 0x1FD6, 0x1FDB }, { 0x1FE0, 0x1FEC }, { 0x1FF2, 0x1FF4 }, { 0x1FF6, 0x1FFC }, { 0x2070, 0x2071 },
+    { 0x2074, 0x2079 }, { 0x207F, 0x2089 }, { 0x2090, 0x209C }, { 0x2102, 0x2102 }, { 0x2107, 0x2107 },
+    { 0x210A, 0x2113 }, { 0x2115, 0x2115 }, { 0x2119, 0x211D }, { 0x2124, 0x2124 }, { 0x2126, 0x2126 },
+    { 0x2128, 0x2128 }, { 0x212A, 0x212D }, { 0x212F, 0x2139 }, { 0x213C, 0x213F }, { 0x2145, 0x2149 },
+    { 0x214E, 0x214E }, { 0x2150, 0x2189 }, { 0x2460, 0x249B }, { 0x24EA, 0x24FF }, { 0x2776, 0x2793 },
+    { 0x2C00, 0x2CE4 }, { 0x2CEB, 0x2CEE }, { 0x2CF2, 0x2CF3 }, { 0x2CFD, 0x2CFD }, { 0x2D00, 0x2D25 },
+    { 0x2D27, 0x2D27 }, { 0x2D2D, 0x2D2D }, { 0x2D30, 0x2D67 }, { 0x2D6F, 0x2D6F }, { 0x2D80, 0x2D96 },
+    { 0x2DA0, 0x2DA6 }, { 0x2DA8, 0x2DAE }, { 0x2DB0, 0x2DB6 }, { 0x2DB8, 0x2DBE }, { 0x2DC0, 0x2DC6 },
+    { 0x2DC8, 0x2DCE }, { 0x2DD0, 0x2DD6 }, { 0x2DD8, 0x2DDE }, { 0x2E2F, 0x2E2F }, { 0x3005, 0x3007 },
+    { 0x3021, 0x3029 }, { 0x3031, 0x3035 }, { 0x3038, 0x303C }, { 0x3041, 0x3096 }, { 0x309D, 0x309F },
+    { 0x30A1, 0x30FA }, { 0x30FC, 0x30FF }, { 0x3105, 0x312F }, { 0x3131, 0x318E }, { 0x3192, 0x3195 },
+    { 0x31A0, 0x31BF }, { 0x31F0, 0x31FF }, { 0x3220, 0x3229 }, { 0x3248, 0x324F }, { 0x3251, 0x325F },
+    { 0x3280, 0x3289 }, { 0x32B1, 0x32BF }, { 0x3400, 0x4DBF }, { 0x4E00, 0xA48C }, { 0xA4D0, 0xA4FD },
+    { 0xA500, 0xA60C }, { 0xA610, 0xA62B }, { 0xA640, 0xA66E }, { 0xA67F, 0xA69D }, { 0xA6A0, 0xA6EF },
+    { 0xA717, 0xA71F }, { 0xA722, 0xA788 }, { 0xA78B, 0xA7CA }, { 0xA7D0, 0xA7D1 }, { 0xA7D3, 0xA7D3 },
+    { 0xA7D5, 0xA7D9 }, { 0xA7F2, 0xA801 }, { 0xA803, 0xA805 }, { 0xA807, 0xA80A }, { 0xA80C, 0xA822 },
+    { 0xA830, 0xA835 }, { 0xA840, 0xA873 }, { 0xA882, 0xA8B3 }, { 0xA8D0, 0xA8D9 }, { 0xA8F2, 0xA8F7 },
+    { 0xA8FB, 0xA8FB }, { 0xA8FD, 0xA8FE }, { 0xA900, 0xA925 }, { 0xA930, 0xA946 }, { 0xA960, 0xA97C },
+    { 0xA984, 0xA9B2 }, { 0xA9CF, 0xA9D9 }, { 0xA9E0, 0xA9E4 }, { 0xA9E6, 0xA9FE }, { 0xAA00, 0xAA28 },
+    { 0xAA40, 0xAA42 }, { 0xAA44, 0xAA4B }, { 0xAA50, 0xAA59 }, { 0xAA60, 0xAA76 }, { 0xAA7A, 0xAA7A },
+    { 0xAA7E, 0xAAAF }, { 0xAAB1, 0xAAB1 }, { 0xAAB5, 0xAAB6 }, { 0xAAB9, 0xAABD }, { 0xAAC0, 0xAAC0 },
+    { 0xAAC2, 0xAAC2 }, { 0xAADB, 0xAADD }, { 0xAAE0, 0xAAEA }, { 0xAAF2, 0xAAF4 }, { 0xAB01, 0xAB06 },
+    { 0xAB09, 0xAB0E }, { 0xAB11, 0xAB16 }, { 0xAB20, 0xAB26 }, { 0xAB28, 0xAB2E }, { 0xAB30, 0xAB5A },
+    { 0xAB5C, 0xAB69 }, { 0xAB70, 0xABE2 }, { 0xABF0, 0xABF9 }, { 0xAC00, 0xD7A3 }, { 0xD7B0, 0xD7C6 },
+    { 0xD7CB, 0xD7FB }, { 0xF900, 0xFA6D }, { 0xFA70, 0xFAD9 }, { 0xFB00, 0xFB06 }, { 0xFB13, 0xFB17 },
+    { 0xFB1D, 0xFB1D }, { 0xFB1F, 0xFB28 }, { 0xFB2A, 0xFB36 }, { 0xFB38, 0xFB3C }, { 0xFB3E, 0xFB3E },
+    { 0xFB40, 0xFB41 }, { 0xFB43, 0xFB44 }, { 0xFB46, 0xFBB1 }, { 0xFBD3, 0xFD3D }, { 0xFD50, 0xFD8F },
+    { 0xFD92, 0xFDC7 }, { 0xFDF0, 0xFDFB }, { 0xFE70, 0xFE74 }, { 0xFE76, 0xFEFC }, { 0xFF10, 0xFF19 },
+    { 0xFF21, 0xFF3A }, { 0xFF41, 0xFF5A }, { 0xFF66, 0xFFBE }, { 0xFFC2, 0xFFC7 }, { 0xFFCA, 0xFFCF },
+    { 0xFFD2, 0xFFD7 }, { 0xFFDA, 0xFFDC }, { 0x10000, 0x1000B }, { 0x1000D, 0x10026 }, { 0x10028, 0x1003A },
+    { 0x1003C, 0x1003D }, { 0x1003F, 0x1004D }, { 0x10050, 0x1005D }, { 0x10080, 0x100FA }, { 0x10107, 0x10133 },
+    { 0x10140, 0x10178 }, { 0x1018A, 0x1018B }, { 0x10280, 0x1029C }, { 0x102A0, 0x102D0 }, { 0x102E1, 0x102FB },
+    { 0x10300, 0x10323 }, { 0x1032D, 0x1034A }, { 0x10350, 0x10375 }, { 0x10380, 0x1039D }, { 0x103A0, 0x103C3 },
+    { 0x103C8, 0x103CF }, { 0x103D1, 0x103D5 }, { 0x10400, 0x1049D }, { 0x104A0, 0x104A9 }, { 0x104B0, 0x104D3 },
+    { 0x104D8, 0x104FB }, { 0x10500, 0x10527 }, { 0x10530, 0x10563 }, { 0x10570, 0x1057A }, { 0x1057C, 0x1058A },
+    { 0x1058C, 0x10592 }, { 0x10594, 0x10595 }, { 0x10597, 0x105A1 }, { 0x105A3, 0x105B1 }, { 0x105B3, 0x105B9 },
+    { 0x105BB, 0x105BC }, { 0x10600, 0x10736 }, { 0x10740, 0x10755 }, { 0x10760, 0x10767 }, { 0x10780, 0x10785 },
+    { 0x10787, 0x107B0 }, { 0x107B2, 0x107BA }, { 0x10800, 0x10805 }, { 0x10808, 0x10808 }, { 0x1080A, 0x10835 },
+    { 0x10837, 0x10838 }, { 0x1083C, 0x1083C }, { 0x1083F, 0x10855 }, { 0x10858, 0x10876 }, { 0x10879, 0x1089E },
+    { 0x108A7, 0x108AF }, { 0x108E0, 0x108F2 }, { 0x108F4, 0x108F5 }, { 0x108FB, 0x1091B }, { 0x10920, 0x10939 },
+    { 0x10980, 0x109B7 }, { 0x109BC, 0x109CF }, { 0x109D2, 0x10A00 }, { 0x10A10, 0x10A13 }, { 0x10A15, 0x10A17 },
+    { 0x10A19, 0x10A35 }, { 0x10A40, 0x10A48 }, { 0x10A60, 0x10A7E }, { 0x10A80, 0x10A9F }, { 0x10AC0, 0x10AC7 },
+    { 0x10AC9, 0x10AE4 }, { 0x10AEB, 0x10AEF }, { 0x10B00, 0x10B35 }, { 0x10B40, 0x10B55 }, { 0x10B58, 0x10B72 },
+    { 0x10B78, 0x10B91 }, { 0x10BA9, 0x10BAF }, { 0x10C00, 0x10C48 }, { 0x10C80, 0x10CB2 }, { 0x10CC0, 0x10CF2 },
+    { 0x10CFA, 0x10D23 }, { 0x10D30, 0x10D39 }, { 0x10E60, 0x10E7E }, { 0x10E80, 0x10EA9 }, { 0x10EB0, 0x10EB1 },
+    { 0x10F00, 0x10F27 }, { 0x10F30, 0x10F45 }, { 0x10F51, 0x10F54 }, { 0x10F70, 0x10F81 }, { 0x10FB0, 0x10FCB },
+    { 0x10FE0, 0x10FF6 }, { 0x11003, 0x11037 }, { 0x11052, 0x1106F }, { 0x11071, 0x11072 }, { 0x11075, 0x11075 },
+    { 0x11083, 0x110AF }, { 0x110D0, 0x110E8 }, { 0x110F0, 0x110F9 }, { 0x11103, 0x11126 }, { 0x11136, 0x1113F },
+    { 0x11144, 0x11144 }, { 0x11147, 0x11147 }, { 0x11150, 0x11172 }, { 0x11176, 0x11176 }, { 0x11183, 0x111B2 },
+    { 0x111C1, 0x111C4 }, { 0x111D0, 0x111DA }, { 0x111DC, 0x111DC }, { 0x111E1, 0x111F4 }, { 0x11200, 0x11211 },
+    { 0x11213, 0x1122B }, { 0x11280, 0x11286 }, { 0x11288, 0x11288 }, { 0x1128A, 0x1128D }, { 0x1128F, 0x1129D },
+    { 0x1129F, 0x112A8 }, { 0x112B0, 0x112DE }, { 0x112F0, 0x112F9 }, { 0x11305, 0x1130C }, { 0x1130F, 0x11310 },
+    { 0x11313, 0x11328 }, { 0x1132A, 0x11330 }, { 0x11332, 0x11333 }, { 0x11335, 0x11339 }, { 0x1133D, 0x1133D },
+    { 0x11350, 0x11350 }, { 0x1135D, 0x11361 }, { 0x11400, 0x11434 }, { 0x11447, 0x1144A }, { 0x11450, 0x11459 },
+    { 0x1145F, 0x11461 }, { 0x11480, 0x114AF }, { 0x114C4, 0x114C5 }, { 0x114C7, 0x114C7 }, { 0x114D0, 0x114D9 },
+    { 0x11580, 0x115AE }, { 0x115D8, 0x115DB }, { 0x11600, 0x1162F }, { 0x11644, 0x11644 }, { 0x11650, 0x11659 },
+    { 0x11680, 0x116AA }, { 0x116B8, 0x116B8 }, { 0x116C0, 0x116C9 }, { 0x11700, 0x1171A }, { 0x11730, 0x1173B },
+    { 0x11740, 0x11746 }, { 0x11800, 0x1182B }, { 0x118A0, 0x118F2 }, { 0x118FF, 0x11906 }, { 0x11909, 0x11909 },
+    { 0x1190C, 0x11913 }, { 0x11915, 0x11916 }, { 0x11918, 0x1192F }, { 0x1193F, 0x1193F }, { 0x11941, 0x11941 },
+    { 0x11950, 0x11959 }, { 0x119A0, 0x119A7 }, { 0x119AA, 0x119D0 }, { 0x119E1, 0x119E1 }, { 0x119E3, 0x119E3 },
+    { 0x11A00, 0x11A00 }, { 0x11A0B, 0x11A32 }, { 0x11A3A, 0x11A3A }, { 0x11A50, 0x11A50 }, { 0x11A5C, 0x11A89 },
+    { 0x11A9D, 0x11A9D }, { 0x11AB0, 0x11AF8 }, { 0x11C00, 0x11C08 }, { 0x11C0A, 0x11C2E }, { 0x11C40, 0x11C40 },
+    { 0x11C50, 0x11C6C }, { 0x11C72, 0x11C8F }, { 0x11D00, 0x11D06 }, { 0x11D08, 0x11D09 }, { 0x11D0B, 0x11D30 },
+    { 0x11D46, 0x11D46 }, { 0x11D50, 0x11D59 }, { 0x11D60, 0x11D65 }, { 0x11D67, 0x11D68 }, { 0x11D6A, 0x11D89 },
+    { 0x11D98, 0x11D98 }, { 0x11DA0, 0x11DA9 }, { 0x11EE0, 0x11EF2 }, { 0x11FB0, 0x11FB0 }, { 0x11FC0, 0x11FD4 },
+    { 0x12000, 0x12399 }, { 0x12400, 0x1246E }, { 0x12480, 0x12543 }, { 0x12F90, 0x12FF0 }, { 0x13000, 0x1342E },
+    { 0x14400, 0x14646 }, { 0x16800, 0x16A38 }, { 0x16A40, 0x16A5E }, { 0x16A60, 0x16A69 }, { 0x16A70, 0x16ABE },
+    { 0x16AC0, 0x16AC9 }, { 0x16AD0, 0x16AED }, { 0x16B00, 0x16B2F }, { 0x16B40, 0x16B43 }, { 0x16B50, 0x16B59 },
+    { 0x16B5B, 0x16B61 }, { 0x16B63, 0x16B77 }, { 0x16B7D, 0x16B8F }, { 0x16E40, 0x16E96 }, { 0x16F00, 0x16F4A },
+    { 0x16F50, 0x16F50 }, { 0x16F93, 0x16F9F }, { 0x16FE0, 0x16FE1 }, { 0x16FE3, 0x16FE3 }, { 0x17000, 0x187F7 },
+    { 0x18800, 0x18CD5 }, { 0x18D00, 0x18D08 }, { 0x1AFF0, 0x1AFF3 }, { 0x1AFF5, 0x1AFFB }, { 0x1AFFD, 0x1AFFE },
+    { 0x1B000, 0x1B122 }, { 0x1B150, 0x1B152 }, { 0x1B164, 0x1B167 }, { 0x1B170, 0x1B2FB }, { 0x1BC00, 0x1BC6A },
+    { 0x1BC70, 0x1BC7C }, { 0x1BC80, 0x1BC88 }, { 0x1BC90, 0x1BC99 }, { 0x1D2E0, 0x1D2F3 }, { 0x1D360, 0x1D378 },
+    { 0x1D400, 0x1D454 }, { 0x1D456, 0x1D49C }, { 0x1D49E, 0x1D49F }, { 0x1D4A2, 0x1D4A2 }, { 0x1D4A5, 0x1D4A6 },
+    { 0x1D4A9, 0x1D4AC }, { 0x1D4AE, 0x1D4B9 }, { 0x1D4BB, 0x1D4BB }, { 0x1D4BD, 0x1D4C3 }, { 0x1D4C5, 0x1D505 },
+    { 0x1D507, 0x1D50A }, { 0x1D50D, 0x1D514 }, { 0x1D516, 0x1D51C }, { 0x1D51E, 0x1D539 }, { 0x1D53B, 0x1D53E },
+    { 0x1D540, 0x1D544 }, { 0x1D546, 0x1D546 }, { 0x1D54A, 0x1D550 }, { 0x1D552, 0x1D6A5 }, { 0x1D6A8, 0x1D6C0 },
+    { 0x1D6C2, 0x1D6DA }, { 0x1D6DC, 0x1D6FA }, { 0x1D6FC, 0x1D714 }, { 0x1D716, 0x1D734 }, { 0x1D736, 0x1D74E },
+    { 0x1D750, 0x1D76E }, { 0x1D770, 0x1D788 }, { 0x1D78A, 0x1D7A8 }, { 0x1D7AA, 0x1D7C2 }, { 0x1D7C4, 0x1D7CB },
+    { 0x1D7CE, 0x1D7FF }, { 0x1DF00, 0x1DF1E }, { 0x1E100, 0x1E12C }, { 0x1E137, 0x1E13D }, { 0x1E140, 0x1E149 },
+    { 0x1E14E, 0x1E14E }, { 0x1E290, 0x1E2AD }, { 0x1E2C0, 0x1E2EB }, { 0x1E2F0, 0x1E2F9 }, { 0x1E7E0, 0x1E7E6 },
+    { 0x1E7E8, 0x1E7EB }, { 0x1E7ED, 0x1E7EE }, { 0x1E7F0, 0x1E7FE }, { 0x1E800, 0x1E8C4 }, { 0x1E8C7, 0x1E8CF },
+    { 0x1E900, 0x1E943 }, { 0x1E94B, 0x1E94B }, { 0x1E950, 0x1E959 }, { 0x1EC71, 0x1ECAB }, { 0x1ECAD, 0x1ECAF },
+    { 0x1ECB1, 0x1ECB4 }, { 0x1ED01, 0x1ED2D }, { 0x1ED2F, 0x1ED3D }, { 0x1EE00, 0x1EE03 }, { 0x1EE05, 0x1EE1F },
+    { 0x1EE21, 0x1EE22 }, { 0x1EE24, 0x1EE24 }, { 0x1EE27, 0x1EE27 }, { 0x1EE29, 0x1EE32 }, { 0x1EE34, 0x1EE37 },
+    { 0x1EE39, 0x1EE39 }, { 0x1EE3B, 0x1EE3B }, { 0x1EE42, 0x1EE42 }, { 0x1EE47, 0x1EE47 }, { 0x1EE49, 0x1EE49 },
+    { 0x1EE4B, 0x1EE4B }, { 0x1EE4D, 0x1EE4F }, { 0x1EE51, 0x1EE52 }, { 0x1EE54, 0x1EE54 }, { 0x1EE57, 0x1EE57 },
+    { 0x1EE59, 0x1EE59 }, { 0x1EE5B, 0x1EE5B }, { 0x1EE5D, 0x1EE5D }, { 0x1EE5F, 0x1EE5F }, { 0x1EE61, 0x1EE62 },
+    { 0x1EE64, 0x1EE64 }, { 0x1EE67, 0x1EE6A }, { 0x1EE6C, 0x1EE72 }, { 0x1EE74, 0x1EE77 }, { 0x1EE79, 0x1EE7C },
+    { 0x1EE7E, 0x1EE7E }, { 0x1EE80, 0x1EE89 }, { 0x1EE8B, 0x1EE9B }, { 0x1EEA1, 0x1EEA3 }, { 0x1EEA5, 0x1EEA9 },
+    { 0x1EEAB, 0x1EEBB }, { 0x1F100, 0x1F10C }, { 0x1FBF0, 0x1FBF9 }, { 0x20000, 0x2A6DF }, { 0x2A700, 0x2B738 },
+    { 0x2B740, 0x2B81D }, { 0x2B820, 0x2CEA1 }, { 0x2CEB0, 0x2EBE0 }, { 0x2F800, 0x2FA1D }, { 0x30000, 0x3134A },
+};
+
+// Wide characters above ASCII with the Unicode White_Space property.
+static const int nrex_unicode_space[][2] = {
+    { 0x85, 0x85 }, { 0xA0, 0xA0 }, { 0x1680, 0x1680 }, { 0x2000, 0x200A },
+    { 0x2028, 0x2029 }, { 0x202F, 0x202F }, { 0x205F, 0x205F }, { 0x3000, 0x3000 },
+};
+
+static bool nrex_in_table(const int (*table)[2], int count, nrex_point c)
+{
+    int low = 0;
+    int high = count;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (nrex_point(table[mid][1]) < c)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low < count && nrex_point(table[low][0]) <= c;
+}
+#endif
+
+static bool nrex_is_word(nrex_point c)
+{
+    if ((unsigned int)c < 0x80)
+    {
+        return (nrex_ascii_classes[(unsigned int)c] & NREX_CLASS(word)) != 0;
+    }
+#if defined(NREX_UNICODE) || defined(NREX_UTF8)
+    return nrex_in_table(nrex_unicode_word, sizeof(nrex_unicode_word) / sizeof(nrex_unicode_word[0]), c);
+#else
+    return false;
+#endif
+}
+
+static bool nrex_is_space(nrex_point c)
+{
+    if ((unsigned int)c < 0x80)
+    {
+        return (nrex_ascii_classes[(unsigned int)c] & NREX_CLASS(space)) != 0;
+    }
+#if defined(NREX_UNICODE) || defined(NREX_UTF8)
+    return nrex_in_table(nrex_unicode_space, sizeof(nrex_unicode_space) / sizeof(nrex_unicode_space[0]), c);
+#else
+    return false;
+#endif
+}
+
+#undef NREX_CLASS
+
+struct nrex_node_class : public nrex_node
+{
+        nrex_class_type type;
+
+        nrex_node_class(nrex_class_type t)
+            : nrex_node(true)
+            , type(t)
+        {
+            length = 1;
+        }
+
+        bool first(nrex_charset* set) const
+        {
+            for (int i = 0; i <= 0xFF; ++i)
+            {
+                if (test_class(nrex_point(i)))
+                {
+                    set->add(nrex_point(i));
+                }
+            }
+            return false;
+        }
+
+        bool test_class(nrex_point c) const
+        {
+            return nrex_test_class(type, c);
+        }
+
+        void lower(nrex_program* p) const
+        {
+            p->emit(nrex_op_class, type);
+        }
+};
+
+static bool nrex_is_shorthand(nrex_char repr)
+{
+    switch (repr)
+    {
+        case 'W':
+        case 'w':
+        case 'D':
+        case 'd':
+        case 'S':
+        case 's':
+            return true;
+    }
+    return false;
+}
+
+static bool nrex_test_shorthand(nrex_char repr, nrex_point c)
+{
+    bool found = false;
+    bool invert = false;
+    switch (repr)
+    {
+        case '.':
+            found = true;
+            break;
+        case 'W':
+            invert = true;
+            // fall through
+        case 'w':
+            if (nrex_is_word(c))
+            {
+                found = true;
+            }
+            break;
+        case 'D':
+            invert = true;
+            // fall through
+        case 'd':
+            if ('0' <= c && c <= '9')
+            {
+                found = true;
+            }
+            break;
+        case 'S':
+            invert = true;
+            // fall through
+        case 's':
+            if (nrex_is_space(c))
+            {
+                found = true;
+            }
+            break;
+    }
+    return found != invert;
+}
+
+struct nrex_node_shorthand : public nrex_node
+{
+        nrex_char repr;
+
+        nrex_node_shorthand(nrex_char c)
+            : nrex_node(true)
+            , repr(c)
+        {
+            length = 1;
+        }
+
+        bool test_char(nrex_point c) const
+        {
+            return nrex_test_shorthand(repr, c);
+        }
+
+        int width() const
+        {
+#ifdef NREX_UTF8
+            if (repr != 'd')
+            {
+                return -1;
+            }
+#endif
+            return 1;
+        }
+
+        bool single() const
+        {
+            return true;
+        }
+
+        bool first(nrex_charset* set) const
+        {
+            for (int i = 0; i <= 0xFF; ++i)
+            {
+                if (test_char(nrex_point(i)))
+                {
+                    set->add(nrex_point(i));
+                }
+            }
+            if (repr != 'd')
+            {
+                set->widen();
+            }
+            return false;
+        }
+
+        void lower(nrex_program* p) const
+        {
+            p->emit(nrex_op_shorthand, repr);
+        }
+};
+
+static bool nrex_word_before(const nrex_char* str, int pos)
+{
+    if (pos == 0)
+    {
+        return false;
+    }
+    nrex_point c;
+    nrex_prev(str, pos, &c);
+    return nrex_is_word(c);
+}
+
+static bool nrex_word_after(const nrex_char* str, int pos, int end)
+{
+    if (pos == end)
+    {
+        return false;
+    }
+    nrex_point c;
+    nrex_next(str, pos, end, &c);
+    return nrex_is_word(c);
+}
+
+static bool nrex_at_word_boundary(const nrex_char* str, int pos, int end)
+{
+    return nrex_word_before(str, pos) != nrex_word_after(str, pos, end);
+}
+
+static bool nrex_consume(const nrex_program* p, const nrex_inst& inst, nrex_point c)
+{
+    switch (inst.op)
+    {
+        case nrex_op_char:
+            return c == nrex_point(inst.x);
+        case nrex_op_range:
+            return nrex_point(inst.x) <= c && c <= nrex_point(inst.y);
+        case nrex_op_class:
+            return nrex_test_class(nrex_class_type(inst.x), c);
+        case nrex_op_shorthand:
+            return nrex_test_shorthand(nrex_char(inst.x), c);
+        case nrex_op_bracket:
+        {
+            const nrex_bracket& set = p->brackets[inst.z];
+            if ((unsigned int)c <= 0xFF || sizeof(nrex_point) == 1)
+            {
+                unsigned char b = (unsigned char)c;
+                return (set.bits[b >> 3] & (1 << (b & 7))) != 0;
+            }
+            int low = 0;
+            int high = set.ranges;
+            while (low < high)
+            {
+                int mid = (low + high) / 2;
+                if (nrex_point(p->items[inst.x + mid].y) < c)
+                {
+                    low = mid + 1;
+                }
+                else
+                {
+                    high = mid;
+                }
+            }
+            bool member = (low < set.ranges && nrex_point(p->items[inst.x + low].x) <= c);
+            for (int i = set.ranges; i < inst.y && !member; ++i)
+            {
+                member = nrex_consume(p, p->items[inst.x + i], c);
+            }
+            return member != (set.negate != 0);
+        }
+    }
+    return false;
+}
+
+static bool nrex_is_quantifier(nrex_char repr)
+{
+    switch (repr)
+    {
+        case '?':
+        case '*':
+        case '+':
+        case '{':
+            return true;
+    }
+    return false;
+}
+
+struct nrex_node_quantifier : public nrex_node
+{
+        int min;
+        int max;
+        bool greedy;
+        bool possessive;
+        nrex_node* child;
+
+        nrex_node_quantifier(int min, int max)
+            : nrex_node()
+            , min(min)
+            , max(max)
+            , greedy(true)
+            , possessive(false)
+            , child(NULL)
+        {
+        }
+
+        nrex_node_quantifier* quantifier()
+        {
+            return this;
+        }
+
+        // Folds a quantifier directly around another, as in `(?:a+)*`, into
+        // one when both are ?, * or + of the same kind over a single
+        // character. Either way the longest (or shortest) workable count
+        // is found first, so the match does not change.
+        nrex_node* optimize(nrex_arena* arena)
+        {
+            child = child->optimize(arena);
+            child->parent = this;
+            child->previous = NULL;
+            child->next = NULL;
+            nrex_node_quantifier* inner = child->quantifier();
+            if (!inner || possessive || inner->possessive || greedy != inner->greedy || !inner->child->single())
+            {
+                return this;
+            }
+            if (min > 1 || inner->min > 1 || (max != 1 && max >= 0) || (inner->max != 1 && inner->max >= 0))
+            {
+                return this;
+            }
+            min = min * inner->min;
+            max = (max < 0 || inner->max < 0) ? -1 : 1;
+            length = -1;
+            child = inner->child;
+            child->parent = this;
+            return this;
+        }
+
+        bool first(nrex_charset* set) const
+        {
+            return child->first(set) || min == 0;
+        }
+
+        bool prefixes(nrex_literals* set) const
+        {
+            return min > 0 && child->prefixes_chain(set);
+        }
+
+        int width() const
+        {
+            int w = child->width();
+            if (min != max || w < 0)
+            {
+                return -1;
+            }
+            return w * min;
+        }
+
+        bool anchored_start() const
+        {
+            return min > 0 && child->anchored_start();
+        }
+
+        void lower(nrex_program* p) const
+        {
+            if (p->backtrack)
+            {
+                lower_loop(p);
+                return;
+            }
+            if (possessive)
+            {
+                p->pike = false;
+                return;
+            }
+            // Threads are told apart by pc alone, so a loop whose body can
+            // match nothing keeps the position each pass started at in a
+            // register. A pass that took nothing leaves the loop right away,
+            // as repeat() does, instead of running the next pass.
+            nrex_charset first;
+            bool empty = (max < 0 || max > min + 1 || (min > 0 && max > min)) && child->first(&first);
+            int reg = empty ? p->registers++ : -1;
+            int progress = -1;
+            for (int i = 0; i < min && p->lowering(); ++i)
+            {
+                if (empty && i + 1 == min)
+                {
+                    p->emit(nrex_op_save, reg);
+                }
+                child->lower_node(p);
+            }
+            if (empty && min > 0)
+            {
+                progress = p->emit(nrex_op_progress, reg, 0, progress);
+            }
+            if (max < 0)
+            {
+                int loop = p->emit(nrex_op_split);
+                if (empty)
+                {
+                    p->emit(nrex_op_save, reg);
+                }
+                child->lower_node(p);
+                if (empty)
+                {
+                    progress = p->emit(nrex_op_progress, reg, 0, progress);
+                }
+                p->emit(nrex_op_jump, loop);
+                p->set_split(loop, loop + 1, p->code.size(), greedy);
+            }
+            int pending = -1;
+            for (int i = min; i < max && p->lowering(); ++i)
+            {
+                pending = p->emit(nrex_op_split, 0, 0, pending);
+                if (empty && i + 1 < max)
+                {
+                    p->emit(nrex_op_save, reg);
+                    child->lower_node(p);
+                    progress = p->emit(nrex_op_progress, reg, 0, progress);
+                }
+                else
+                {
+                    child->lower_node(p);
+                }
+            }
+            while (pending >= 0)
+            {
+                int split = pending;
+                pending = p->code[split].z;
+                p->code[split].z = 0;
+                p->set_split(split, split + 1, p->code.size(), greedy);
+            }
+            while (progress >= 0)
+            {
+                int check = progress;
+                progress = p->code[check].z;
+                p->code[check].y = p->code.size();
+                p->code[check].z = 0;
+            }
+        }
+
+        void lower_loop(nrex_program* p) const
+        {
+            int atomic = possessive ? p->emit(nrex_op_atomic) : -1;
+            int reg = p->registers;
+            p->registers += 2;
+            int init = p->emit(nrex_op_repeat_init, reg);
+            int body = p->code.size();
+            child->lower_node(p);
+            int op = (p->code.size() == (unsigned int)body + 1) ? p->code[body].op : nrex_op_match;
+            if (nrex_op_char <= op && op <= nrex_op_bracket && child->width() == 1)
+            {
+                nrex_inst inst = p->code[body];
+                p->code.resize(atomic >= 0 ? atomic : init);
+                p->registers -= 2;
+                p->emit(nrex_op_span, min, max, possessive ? 2 : (greedy ? 1 : 0));
+                p->emit(inst.op, inst.x, inst.y, inst.z);
+                return;
+            }
+            p->code[init].y = p->code.size();
+            nrex_charset first;
+            int flags = (greedy ? 1 : 0) | (child->first(&first) ? 0 : 2);
+            nrex_inst item = { flags, min, max, reg };
+            p->items.push(item);
+            p->emit(nrex_op_repeat, p->items.size() - 1, body);
+            if (atomic >= 0)
+            {
+                p->emit(nrex_op_look_end);
+                p->code[atomic].y = p->code.size();
+            }
+        }
+
+        bool anchored_end() const
+        {
+            return min > 0 && child->anchored_end();
+        }
+};
+
+struct nrex_node_anchor : public nrex_node
+{
+        bool end;
+
+        nrex_node_anchor(bool end)
+            : nrex_node()
+            , end(end)
+        {
+            length = 0;
+        }
+
+        bool first(nrex_charset*) const
+        {
+            return true;
+        }
+
+        bool anchored_start() const
+        {
+            return !end;
+        }
+
+        bool anchored_end() const
+        {
+            return end;
+        }
+
+        void lower(nrex_program* p) const
+        {
+            p->emit(end ? nrex_op_anchor_end : nrex_op_anchor_start);
+        }
+};
+
+struct nrex_node_word_boundary : public nrex_node
+{
+        bool inverse;
+
+        nrex_node_word_boundary(bool inverse)
+            : nrex_node()
+            , inverse(inverse)
+        {
+            length = 0;
+        }
+
+        bool first(nrex_charset*) const
+        {
+            return true;
+        }
+
+        void lower(nrex_program* p) const
+        {
+            p->emit(nrex_op_word_boundary, inverse);
+        }
+};
+
+struct nrex_node_backreference : public nrex_node
+{
+        int ref;
+
+        nrex_node_backreference(int ref)
+            : nrex_node(true)
+            , ref(ref)
+        {
+            length = -1;
+        }
+
+        void lower(nrex_program* p) const
+        {
+            p->emit(nrex_op_backreference, ref);
+            p->pike = false;
+        }
+};
+
+struct nrex_thread_list
+{
+        int* sparse;
+        int* dense;
+        int* caps;
+        int size;
+        int slots;
+
+        nrex_thread_list()
+            : sparse(NULL)
+            , dense(NULL)
+            , caps(NULL)
+            , size(0)
+            , slots(0)
+        {
+        }
+
+        static int footprint(int count, int slots)
+        {
+            return count * (slots + 2);
+        }
+
+        // Lays the list out over memory owned by the caller.
+        int* attach(int* memory, int count, int slots)
+        {
+            sparse = memory;
+            dense = sparse + count;
+            caps = dense + count;
+            size = 0;
+            this->slots = slots;
+            for (int i = 0; i < count; ++i)
+            {
+                sparse[i] = 0;
+            }
+            return memory + footprint(count, slots);
+        }
+
+        bool contains(int pc) const
+        {
+            return sparse[pc] < size && dense[sparse[pc]] == pc;
+        }
+
+        int insert(int pc)
+        {
+            sparse[pc] = size;
+            dense[size] = pc;
+            return size++;
+        }
+
+        int* thread_caps(int index)
+        {
+            return &caps[index * slots];
+        }
+};
+
+struct nrex_pike_entry
+{
+        int pc;
+        int slot;
+        int value;
+};
+
+struct nrex_pike_level
+{
+        nrex_thread_list lists[2];
+        nrex_thread_list* current;
+        nrex_thread_list* next;
+        nrex_array<nrex_pike_entry> stack;
+        int* memory;
+        bool owned;
+        int* work;
+        int* look;
+
+        nrex_pike_level()
+            : current(NULL)
+            , next(NULL)
+            , memory(NULL)
+            , owned(false)
+            , work(NULL)
+            , look(NULL)
+        {
+        }
+
+        ~nrex_pike_level()
+        {
+            clear();
+        }
+
+        void clear()
+        {
+            if (owned)
+            {
+                NREX_DELETE_ARRAY(memory);
+            }
+            current = NULL;
+            next = NULL;
+            memory = NULL;
+            owned = false;
+        }
+
+        static int footprint(int count, int slots)
+        {
+            return nrex_thread_list::footprint(count, slots) * 2 + slots * 2;
+        }
+
+        // Both thread lists and the capture work space share one block,
+        // taken from the heap unless the caller hands one in.
+        void init(int count, int slots, int* block = NULL)
+        {
+            if (current)
+            {
+                return;
+            }
+            owned = (block == NULL);
+            memory = owned ? NREX_NEW_ARRAY(int, footprint(count, slots)) : block;
+            int* rest = lists[0].attach(memory, count, slots);
+            rest = lists[1].attach(rest, count, slots);
+            work = rest;
+            look = rest + slots;
+            current = &lists[0];
+            next = &lists[1];
+        }
+};
+
+#ifdef NREX_INSTRUMENT
+#define NREX_COUNT(X) X
+
+// How often each instruction was reached, passed and returned to by
+// backtracking, added up over the searches run with one nrex_scratch.
+struct nrex_counters
+{
+        nrex_array<long> visits;
+        nrex_array<long> passes;
+        nrex_array<long> backtracks;
+        long starts;
+
+        nrex_counters()
+            : starts(0)
+        {
+        }
+
+        void clear(int size)
+        {
+            visits.resize(size);
+            passes.resize(size);
+            backtracks.resize(size);
+            for (int i = 0; i < size; ++i)
+            {
+                visits[i] = 0;
+                passes[i] = 0;
+                backtracks[i] = 0;
+            }
+            starts = 0;
+        }
+};
+#else
+#define NREX_COUNT(X)
+#endif
+
+struct nrex_pike
+{
+        const nrex_program* program;
+        const nrex_char* str;
+        int end;
+        nrex_pike_level* levels;
+#ifdef NREX_INSTRUMENT
+        nrex_counters* counters;
+#endif
+
+        nrex_pike(const nrex_program* program, const nrex_char* str, int end, nrex_pike_level* levels)
+            : program(program)
+            , str(str)
+            , end(end)
+            , levels(levels)
+        {
+        }
+
+        void push(int level, int pc, int slot = -1, int value = 0)
+        {
+            nrex_pike_entry entry;
+            entry.pc = pc;
+            entry.slot = slot;
+            entry.value = value;
+            levels[level].stack.push(entry);
+        }
+
+        bool look(int level, int pc, int pos, int* cap)
+        {
+            const nrex_inst& inst = program->code[pc];
+            int* sub = levels[level].look;
+            for (int i = 0; i < program->registers; ++i)
+            {
+                sub[i] = cap[i];
+            }
+            if (search(level + 1, pc + 1, pos, sub, NULL) == (inst.x != 0))
+            {
+                return false;
+            }
+            if (!inst.x)
+            {
+                for (int i = 0; i < program->registers; ++i)
+                {
+                    if (cap[i] != sub[i])
+                    {
+                        push(level, 0, i, cap[i]);
+                        cap[i] = sub[i];
+                    }
+                }
+            }
+            return true;
+        }
+
+        void add(int level, nrex_thread_list* list, int pc, int pos, int* cap)
+        {
+            nrex_array<nrex_pike_entry>& stack = levels[level].stack;
+            push(level, pc);
+            while (stack.size() > 0)
+            {
+                nrex_pike_entry entry = stack.top();
+                stack.pop();
+                if (entry.slot >= 0)
+                {
+                    cap[entry.slot] = entry.value;
+                    continue;
+                }
+                pc = entry.pc;
+                bool follow = true;
+                while (follow && !list->contains(pc))
+                {
+                    int index = list->insert(pc);
+                    const nrex_inst& inst = program->code[pc];
+                    NREX_COUNT(int at = pc; ++counters->visits[at]);
+                    switch (inst.op)
+                    {
+                        case nrex_op_jump:
+                            pc = inst.x;
+                            break;
+                        case nrex_op_split:
+                            push(level, inst.y);
+                            pc = inst.x;
+                            break;
+                        case nrex_op_save:
+                            push(level, 0, inst.x, cap[inst.x]);
+                            cap[inst.x] = pos;
+                            ++pc;
+                            break;
+                        case nrex_op_progress:
+                            pc = (cap[inst.x] == pos) ? inst.y : pc + 1;
+                            break;
+                        case nrex_op_anchor_start:
+                            follow = (pos == 0);
+                            ++pc;
+                            break;
+                        case nrex_op_anchor_end:
+                            follow = (pos == end);
+                            ++pc;
+                            break;
+                        case nrex_op_word_boundary:
+                        {
+                            follow = (nrex_at_word_boundary(str, pos, end) != (inst.x != 0));
+                            ++pc;
+                            break;
+                        }
+                        case nrex_op_look_ahead:
+                            follow = look(level, pc, pos, cap);
+                            pc = inst.y;
+                            break;
+                        default:
+                        {
+                            int* thread = list->thread_caps(index);
+                            for (int i = 0; i < program->registers; ++i)
+                            {
+                                thread[i] = cap[i];
+                            }
+                            follow = false;
+                            break;
+                        }
+                    }
+                    NREX_COUNT(counters->passes[at] += follow ? 1 : 0);
+                }
+            }
+        }
+
+        bool search(int level, int pc, int pos, int* caps, int* hit)
+        {
+            nrex_pike_level& l = levels[level];
+            l.init(program->code.size(), program->registers);
+            nrex_thread_list* current = l.current;
+            nrex_thread_list* next = l.next;
+            current->size = 0;
+            bool matched = false;
+            bool starting = true;
+            bool anchored = (hit == NULL);
+            // The prefilters skip to the next place a match can start, which
+            // may be far ahead. It stays valid until the threads reach it.
+            int start = -1;
+            while (true)
+            {
+                if (starting && !matched)
+                {
+                    if (anchored)
+                    {
+                        start = pos;
+                        starting = false;
+                    }
+                    else if (start < pos)
+                    {
+                        start = program->candidate(str, pos, end, hit);
+                        if (start < 0)
+                        {
+                            starting = false;
+                        }
+                        else if (current->size == 0)
+                        {
+                            pos = start;
+                        }
+                    }
+                    else if (current->size == 0)
+                    {
+                        pos = start;
+                    }
+                    if (start == pos)
+                    {
+                        NREX_COUNT(counters->starts += anchored ? 0 : 1);
+                        for (int i = 0; i < program->registers; ++i)
+                        {
+                            l.work[i] = caps[i];
+                        }
+                        add(level, current, pc, pos, l.work);
+                    }
+                }
+                if (current->size == 0)
+                {
+                    break;
+                }
+                next->size = 0;
+                nrex_point c = 0;
+                int after = (pos < end) ? nrex_next(str, pos, end, &c) : pos;
+                for (int i = 0; i < current->size; ++i)
+                {
+                    const nrex_inst& inst = program->code[current->dense[i]];
+                    if (inst.op == nrex_op_match || inst.op == nrex_op_look_end)
+                    {
+                        int* thread = current->thread_caps(i);
+                        for (int j = 0; j < program->registers; ++j)
+                        {
+                            caps[j] = thread[j];
+                        }
+                        matched = true;
+                        break;
+                    }
+                    if (pos < end && nrex_consume(program, inst, c))
+                    {
+                        NREX_COUNT(++counters->passes[current->dense[i]]);
+                        add(level, next, current->dense[i] + 1, after, current->thread_caps(i));
+                    }
+                }
+                nrex_thread_list* swap = current;
+                current = next;
+                next = swap;
+                if (pos >= end)
+                {
+                    break;
+                }
+                pos = after;
+            }
+            l.current = current;
+            l.next = next;
+            return matched;
+        }
+};
+
+enum nrex_backtrack_kind
+{
+    nrex_backtrack_branch,
+    nrex_backtrack_restore,
+    nrex_backtrack_shrink,
+    nrex_backtrack_extend,
+    nrex_backtrack_loop
+};
+
+struct nrex_backtrack_entry
+{
+        int kind;
+        int pc;
+        int pos;
+        int limit;
+};
+
+#ifndef NREX_MEMO_SIZE
+#define NREX_MEMO_SIZE 1048576
+#endif
+
+#ifndef NREX_DEADLINE_INTERVAL
+#define NREX_DEADLINE_INTERVAL 4096
+#endif
+
+// The limits set on a nrex_match_context and the steps the backtracking
+// machine took towards them in the last search.
+struct nrex_budget
+{
+        long limit;
+        long steps;
+        bool aborted;
+        nrex_deadline_callback deadline;
+        void* data;
+
+        nrex_budget()
+            : limit(0)
+            , steps(0)
+            , aborted(false)
+            , deadline(NULL)
+            , data(NULL)
+        {
+        }
+
+        bool spend()
+        {
+            ++steps;
+            if (limit > 0 && steps > limit)
+            {
+                aborted = true;
+            }
+            else if (deadline && steps % NREX_DEADLINE_INTERVAL == 0 && deadline(data))
+            {
+                aborted = true;
+            }
+            return !aborted;
+        }
+};
+
+struct nrex_backtrack
+{
+        const nrex_program* program;
+        const nrex_char* str;
+        int end;
+        int* regs;
+        nrex_array<nrex_backtrack_entry>& stack;
+        nrex_budget& budget;
+        nrex_array<unsigned int>& visited;
+        int stride;
+        int origin;
+        int cleared;
+        int depth;
+        bool memo;
+#ifdef NREX_INSTRUMENT
+        nrex_counters* counters;
+#endif
+
+        nrex_backtrack(const nrex_program* program, const nrex_char* str, int end, int* regs, nrex_array<nrex_backtrack_entry>& stack, nrex_budget& budget, nrex_array<unsigned int>& visited)
+            : program(program)
+            , str(str)
+            , end(end)
+            , regs(regs)
+            , stack(stack)
+            , budget(budget)
+            , visited(visited)
+            , stride((program->code.size() + 31) / 32)
+            , origin(0)
+            , cleared(0)
+            , depth(0)
+            , memo(false)
+        {
+            stack.clear();
+        }
+
+        void push(int kind, int pc, int pos, int limit = 0)
+        {
+            nrex_backtrack_entry entry;
+            entry.kind = kind;
+            entry.pc = pc;
+            entry.pos = pos;
+            entry.limit = limit;
+            stack.push(entry);
+        }
+
+        void set(int reg, int value)
+        {
+            push(nrex_backtrack_restore, reg, regs[reg]);
+            regs[reg] = value;
+        }
+
+        void unwind(unsigned int base)
+        {
+            while (stack.size() > base)
+            {
+                const nrex_backtrack_entry& entry = stack.top();
+                if (entry.kind == nrex_backtrack_restore)
+                {
+                    regs[entry.pc] = entry.pos;
+                }
+                stack.pop();
+            }
+        }
+
+        void cut(unsigned int base)
+        {
+            unsigned int kept = base;
+            for (unsigned int i = base; i < stack.size(); ++i)
+            {
+                if (stack[i].kind == nrex_backtrack_restore)
+                {
+                    stack[kept++] = stack[i];
+                }
+            }
+            stack.resize(kept);
+        }
+
+        bool backtrack(unsigned int base, int* pc, int* pos)
+        {
+            while (stack.size() > base)
+            {
+                nrex_backtrack_entry entry = stack.top();
+                stack.pop();
+                NREX_COUNT(counters->backtracks[entry.pc] += (entry.kind != nrex_backtrack_restore) ? 1 : 0);
+                switch (entry.kind)
+                {
+                    case nrex_backtrack_restore:
+                        regs[entry.pc] = entry.pos;
+                        break;
+                    case nrex_backtrack_branch:
+                        *pc = entry.pc;
+                        *pos = entry.pos;
+                        return true;
+                    case nrex_backtrack_shrink:
+                        if (entry.pos - 1 > entry.limit)
+                        {
+                            push(nrex_backtrack_shrink, entry.pc, entry.pos - 1, entry.limit);
+                        }
+                        *pc = entry.pc + 2;
+                        *pos = entry.pos - 1;
+                        return true;
+                    case nrex_backtrack_extend:
+                    {
+                        nrex_point c;
+                        nrex_next(str, entry.pos, end, &c);
+                        if (nrex_consume(program, program->code[entry.pc + 1], c))
+                        {
+                            if (entry.pos + 1 < entry.limit)
+                            {
+                                push(nrex_backtrack_extend, entry.pc, entry.pos + 1, entry.limit);
+                            }
+                            *pc = entry.pc + 2;
+                            *pos = entry.pos + 1;
+                            return true;
+                        }
+                        break;
+                    }
+                    case nrex_backtrack_loop:
+                    {
+                        const nrex_inst& inst = program->code[entry.pc];
+                        int reg = program->items[inst.x].z;
+                        set(reg, regs[reg] + 1);
+                        set(reg + 1, entry.pos);
+                        *pc = inst.y;
+                        *pos = entry.pos;
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        bool look(const nrex_inst& inst, int* pc, int* pos)
+        {
+            unsigned int base = stack.size();
+            int start = *pos;
+            if (inst.op == nrex_op_look_behind)
+            {
+                nrex_point c;
+                for (int i = 0; i < inst.z && start >= 0; ++i)
+                {
+                    start = (start > 0) ? nrex_prev(str, start, &c) : -1;
+                }
+            }
+            ++depth;
+            int found = (start >= 0) ? run(*pc + 1, start) : -1;
+            --depth;
+            if (inst.op != nrex_op_atomic && inst.x)
+            {
+                if (found >= 0)
+                {
+                    unwind(base);
+                    return false;
+                }
+                *pc = inst.y;
+                return true;
+            }
+            if (found < 0)
+            {
+                return false;
+            }
+            cut(base);
+            if (inst.op == nrex_op_atomic)
+            {
+                *pos = found;
+            }
+            *pc = inst.y;
+            return true;
+        }
+
+        bool span(const nrex_inst& inst, int pc, int* pos)
+        {
+            const nrex_inst& item = program->code[pc + 1];
+            int start = *pos;
+            int limit = (inst.y < 0 || end - start < inst.y) ? end : start + inst.y;
+            int stop = start;
+            int least = (inst.z == 0 && limit - start > inst.x) ? start + inst.x : limit;
+            nrex_point c;
+            while (stop < least)
+            {
+                nrex_next(str, stop, end, &c);
+                if (!nrex_consume(program, item, c))
+                {
+                    break;
+                }
+                ++stop;
+            }
+            if (stop - start < inst.x)
+            {
+                return false;
+            }
+            if (inst.z == 0 && stop < limit)
+            {
+                push(nrex_backtrack_extend, pc, stop, limit);
+            }
+            else if (inst.z == 1 && stop > start + inst.x)
+            {
+                push(nrex_backtrack_shrink, pc, stop, start + inst.x);
+            }
+            *pos = stop;
+            return true;
+        }
+
+        // Matches the character at pc, along with the ones after it when
+        // nrex_build_runs() marked it as the start of a run.
+        bool string(int pc, int* pos)
+        {
+            const nrex_inst* run = &program->code[pc];
+            int count = (run->z > 1) ? run->z : 1;
+            int at = *pos;
+            for (int i = 0; i < count; ++i)
+            {
+                nrex_point c;
+                if (at >= end)
+                {
+                    return false;
+                }
+                at = nrex_next(str, at, end, &c);
+                if (c != nrex_point(run[i].x))
+                {
+                    return false;
+                }
+            }
+            *pos = at;
+            return true;
+        }
+
+        bool repeat(const nrex_inst& inst, int* pc, int pos)
+        {
+            const nrex_inst& item = program->items[inst.x];
+            int count = regs[item.z];
+            bool empty = (count > 0 && regs[item.z + 1] == pos);
+            bool done = (count >= item.x);
+            bool more = (item.y < 0 || count < item.y) && !(empty && done);
+            bool greedy = (item.op & 1) != 0;
+            if (greedy && more)
+            {
+                if (done)
+                {
+                    push(nrex_backtrack_branch, *pc + 1, pos);
+                }
+                set(item.z, count + 1);
+                set(item.z + 1, pos);
+                *pc = inst.y;
+                return true;
+            }
+            if (!greedy && done)
+            {
+                if (more)
+                {
+                    push(nrex_backtrack_loop, *pc, pos);
+                }
+                ++*pc;
+                return true;
+            }
+            if (done)
+            {
+                ++*pc;
+                return true;
+            }
+            if (more)
+            {
+                set(item.z, count + 1);
+                set(item.z + 1, pos);
+                *pc = inst.y;
+                return true;
+            }
+            return false;
+        }
+
+        int run(int pc, int pos)
+        {
+            unsigned int base = stack.size();
+            while (budget.spend())
+            {
+                const nrex_inst& inst = program->code[pc];
+                if (memo && depth == 0 && inst.op != nrex_op_repeat && seen(pc, pos))
+                {
+                    if (!backtrack(base, &pc, &pos))
+                    {
+                        return -1;
+                    }
+                    continue;
+                }
+                NREX_COUNT(int at = pc; ++counters->visits[at]);
+                bool follow = true;
+                switch (inst.op)
+                {
+                    case nrex_op_match:
+                    case nrex_op_look_end:
+                        return pos;
+                    case nrex_op_jump:
+                        pc = inst.x;
+                        break;
+                    case nrex_op_split:
+                        push(nrex_backtrack_branch, inst.y, pos);
+                        pc = inst.x;
+                        break;
+                    case nrex_op_save:
+                        set(inst.x, pos);
+                        ++pc;
+                        break;
+                    case nrex_op_anchor_start:
+                        follow = (pos == 0);
+                        ++pc;
+                        break;
+                    case nrex_op_anchor_end:
+                        follow = (pos == end);
+                        ++pc;
+                        break;
+                    case nrex_op_word_boundary:
+                    {
+                        follow = (nrex_at_word_boundary(str, pos, end) != (inst.x != 0));
+                        ++pc;
+                        break;
+                    }
+                    case nrex_op_backreference:
+                    {
+                        int start = regs[inst.x * 2];
+                        int length = regs[inst.x * 2 + 1] - start;
+                        if (start >= 0 && length > 0)
+                        {
+                            follow = (length <= end - pos && NREX_MEMCMP(&str[start], &str[pos], length) == 0);
+                            pos += length;
+                        }
+                        ++pc;
+                        break;
+                    }
+                    case nrex_op_look_ahead:
+                    case nrex_op_look_behind:
+                    case nrex_op_atomic:
+                        follow = look(inst, &pc, &pos);
+                        break;
+                    case nrex_op_span:
+                        follow = span(inst, pc, &pos);
+                        pc += 2;
+                        break;
+                    case nrex_op_repeat_init:
+                        set(inst.x, 0);
+                        set(inst.x + 1, -1);
+                        pc = inst.y;
+                        break;
+                    case nrex_op_repeat:
+                        follow = repeat(inst, &pc, pos);
+                        break;
+                    case nrex_op_char:
+                        follow = string(pc, &pos);
+                        pc += (inst.z > 1) ? inst.z : 1;
+                        break;
+                    default:
+                    {
+                        nrex_point c;
+                        follow = (pos < end);
+                        if (follow)
+                        {
+                            pos = nrex_next(str, pos, end, &c);
+                            follow = nrex_consume(program, inst, c);
+                        }
+                        ++pc;
+                        break;
+                    }
+                }
+                NREX_COUNT(counters->passes[at] += follow ? 1 : 0);
+                if (!follow && !backtrack(base, &pc, &pos))
+                {
+                    return -1;
+                }
+            }
+            return -1;
+        }
+
+        // Marks an instruction outside of any lookaround as tried at a
+        // position and tells whether it already was, in which case every
+        // way on from there has failed before.
+        bool seen(int pc, int pos)
+        {
+            int row = pos - origin;
+            for (; cleared <= row; ++cleared)
+            {
+                for (int i = 0; i < stride; ++i)
+                {
+                    visited[cleared * stride + i] = 0;
+                }
+            }
+            unsigned int& word = visited[row * stride + pc / 32];
+            unsigned int bit = 1u << (pc % 32);
+            bool result = (word & bit) != 0;
+            word |= bit;
+            return result;
+        }
+
+        bool search(int pos, int* hit)
+        {
+            origin = pos;
+            cleared = 0;
+            memo = program->memo && (end - pos + 1 <= NREX_MEMO_SIZE / 32 / stride);
+            if (memo)
+            {
+                visited.resize((end - pos + 1) * stride);
+            }
+            for (; pos <= end; pos = nrex_skip(str, pos, end))
+            {
+                pos = program->candidate(str, pos, end, hit);
+                if (pos < 0)
+                {
+                    return false;
+                }
+                NREX_COUNT(++counters->starts);
+                if (run(0, pos) >= 0)
+                {
+                    return true;
+                }
+                if (budget.aborted)
+                {
+                    return false;
+                }
+            }
+            return false;
+        }
+};
+
+// Lowering leaves a bracket with its items in pattern order and its
+// negation in z. This replaces z with the index of a compiled bracket and
+// moves the characters and ranges, sorted and merged, in front of the
+// classes.
+static void nrex_build_brackets(nrex_program* p)
+{
+    for (unsigned int pc = 0; pc < p->code.size(); ++pc)
+    {
+        nrex_inst& inst = p->code[pc];
+        if (inst.op != nrex_op_bracket)
+        {
+            continue;
+        }
+        nrex_bracket set;
+        memset(set.bits, 0, sizeof(set.bits));
+        set.negate = inst.z;
+        for (int i = 0; i < 256; ++i)
+        {
+            bool member = false;
+            for (int j = 0; j < inst.y && !member; ++j)
+            {
+                member = nrex_consume(p, p->items[inst.x + j], nrex_point(i));
+            }
+            if (member != (set.negate != 0))
+            {
+                set.bits[i >> 3] |= (unsigned char)(1 << (i & 7));
+            }
+        }
+        int ranges = 0;
+        for (int i = 0; i < inst.y; ++i)
+        {
+            nrex_inst item = p->items[inst.x + i];
+            if (item.op == nrex_op_char)
+            {
+                item.op = nrex_op_range;
+                item.y = item.x;
+            }
+            if (item.op == nrex_op_range)
+            {
+                p->items[inst.x + i] = p->items[inst.x + ranges];
+                int j = ranges++;
+                for (; j > 0 && nrex_point(item.x) < nrex_point(p->items[inst.x + j - 1].x); --j)
+                {
+                    p->items[inst.x + j] = p->items[inst.x + j - 1];
+                }
+                p->items[inst.x + j] = item;
+            }
+        }
+        int merged = 0;
+        for (int i = 1; i < ranges; ++i)
+        {
+            nrex_inst& last = p->items[inst.x + merged];
+            const nrex_inst& item = p->items[inst.x + i];
+            if (nrex_point(item.x) <= nrex_point(last.y) + 1)
+            {
+                if (nrex_point(last.y) < nrex_point(item.y))
+                {
+                    last.y = item.y;
+                }
+            }
+            else
+            {
+                ++merged;
+                p->items[inst.x + merged] = item;
+            }
+        }
+        int removed = ranges > 0 ? ranges - merged - 1 : 0;
+        for (int i = ranges; i < inst.y; ++i)
+        {
+            p->items[inst.x + i - removed] = p->items[inst.x + i];
+        }
+        inst.y -= removed;
+        set.ranges = ranges - removed;
+        inst.z = p->brackets.size();
+        p->brackets.push(set);
+    }
+}
+
+// Marks each run of literal characters in a backtracking program with its
+// length in the z of its first instruction, so the machine matches the run
+// in one step. A run never takes in an instruction that is jumped or
+// returned to.
+static void nrex_build_runs(nrex_program* p)
+{
+    int count = p->code.size();
+    nrex_array<bool> target(count);
+    target.resize(count);
+    for (int pc = 0; pc < count; ++pc)
+    {
+        target[pc] = false;
+    }
+    for (int pc = 0; pc < count; ++pc)
+    {
+        const nrex_inst& inst = p->code[pc];
+        switch (inst.op)
+        {
+            case nrex_op_split:
+                target[inst.x] = true;
+                target[inst.y] = true;
+                break;
+            case nrex_op_jump:
+                target[inst.x] = true;
+                break;
+            case nrex_op_look_ahead:
+            case nrex_op_look_behind:
+            case nrex_op_atomic:
+            case nrex_op_repeat_init:
+                target[pc + 1] = true;
+                target[inst.y] = true;
+                break;
+            case nrex_op_span:
+            case nrex_op_repeat:
+                target[pc + 1] = true;
+                target[inst.op == nrex_op_span ? pc + 2 : inst.y] = true;
+                break;
+        }
+    }
+    for (int pc = 0; pc < count; )
+    {
+        int length = 1;
+        if (p->code[pc].op == nrex_op_char)
+        {
+            while (p->code[pc + length].op == nrex_op_char && !target[pc + length])
+            {
+                ++length;
+            }
+            if (length > 1)
+            {
+                p->code[pc].z = length;
+            }
+        }
+        pc += length;
+    }
+}
+
+static void nrex_build_classes(nrex_program* p)
+{
+    int remap[512];
+    for (int i = 0; i < 256; ++i)
+    {
+        p->classmap[i] = 0;
+    }
+    p->classes = 1;
+    for (int pc = -1; pc < (int)p->code.size(); ++pc)
+    {
+        if (pc >= 0 && (p->code[pc].op < nrex_op_char || nrex_op_bracket < p->code[pc].op))
+        {
+            continue;
+        }
+        for (int i = 0; i < 512; ++i)
+        {
+            remap[i] = -1;
+        }
+        int count = 0;
+        for (int i = 0; i < 256; ++i)
+        {
+            nrex_point c = nrex_point(i);
+            bool member = (pc < 0) ? nrex_is_word(c) : nrex_consume(p, p->code[pc], c);
+            int key = p->classmap[i] * 2 + (member ? 1 : 0);
+            if (remap[key] < 0)
+            {
+                remap[key] = count++;
+            }
+            p->classmap[i] = (unsigned char)remap[key];
+        }
+        p->classes = count;
+    }
+}
+
+// Memory handed in by the caller for the length of one call. It is given
+// out front to back and only taken back all at once.
+struct nrex_local_memory
+{
+        char* data;
+        unsigned int size;
+        unsigned int used;
+
+        nrex_local_memory()
+            : data(NULL)
+            , size(0)
+            , used(0)
+        {
+        }
+
+        void* take(unsigned int bytes)
+        {
+            const unsigned int align = sizeof(nrex_arena_align);
+            bytes = (bytes + align - 1) / align * align;
+            if (!data || size - used < bytes)
+            {
+                return NULL;
+            }
+            void* memory = data + used;
+            used += bytes;
+            return memory;
+        }
+
+        template <class T>
+        void lend(nrex_array<T>& array, unsigned int count)
+        {
+            void* memory = take(count * sizeof(T));
+            if (memory)
+            {
+                array.borrow(static_cast<T*>(memory), count);
+                array.clear();
+            }
+        }
+
+        bool owns(const void* memory) const
+        {
+            const char* bytes = static_cast<const char*>(memory);
+            return data && data <= bytes && bytes < data + size;
+        }
+};
+
+struct nrex_sparse_set
+{
+        int* sparse;
+        int* dense;
+        int size;
+        bool owned;
+
+        nrex_sparse_set(int count, int* block = NULL)
+            : sparse(block ? block : NREX_NEW_ARRAY(int, count * 2))
+            , dense(sparse + count)
+            , size(0)
+            , owned(block == NULL)
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                sparse[i] = 0;
+            }
+        }
+
+        ~nrex_sparse_set()
+        {
+            if (owned)
+            {
+                NREX_DELETE_ARRAY(sparse);
+            }
+        }
+
+        bool insert(int value)
+        {
+            if (sparse[value] < size && dense[sparse[value]] == value)
+            {
+                return false;
+            }
+            sparse[value] = size;
+            dense[size++] = value;
+            return true;
+        }
+};
+
+struct nrex_dfa_state
+{
+        int kernel;
+        int count;
+        int flags;
+        int accepts;
+};
+
+#define NREX_DFA_BEHIND_WORD 1
+#define NREX_DFA_ORIGIN 2
+
+#ifndef NREX_DFA_WIDE_CLASSES
+#define NREX_DFA_WIDE_CLASSES 8
+#endif
+
+#define NREX_DFA_WIDE_CACHE 256
+
+struct nrex_dfa
+{
+        const nrex_program* program;
+        const nrex_char* str;
+        int end;
+        bool reverse;
+        bool unanchored;
+        bool all;
+        int restart;
+        int stride;
+        int limit;
+        int capacity;
+        int* table;
+        int* hashes;
+        int hash_mask;
+        int resets;
+        // Set for a call made without a nrex_match_context, whose buffer
+        // is used up before going to the heap.
+        nrex_local_memory* local;
+        nrex_array<nrex_dfa_state> states;
+        nrex_array<int> pool;
+        nrex_array<int> stack;
+        nrex_array<int> closure;
+        nrex_array<int> kernel;
+        nrex_sparse_set visited;
+        nrex_sparse_set added;
+        // Marks the loop registers saved on the way to the instruction being
+        // expanded, which is all a loop needs to tell that its pass took
+        // nothing.
+        nrex_array<int> marks;
+        // Characters above 0xFF are left out of the class map. They are
+        // sorted into classes by the instructions taking them instead, and
+        // the first few classes met get a column of their own.
+        nrex_array<int> consumers;
+        nrex_array<unsigned int> wide_bits;
+        nrex_array<nrex_point> wide_points;
+        nrex_array<int> wide_ids;
+        int wide_words;
+        int wide_count;
+        int reset_pos;
+        int thrash;
+        bool failed;
+        bool streaming;
+
+        nrex_dfa(const nrex_program* program, bool reverse, nrex_local_memory* local = NULL)
+            : program(program)
+            , str(NULL)
+            , end(0)
+            , reverse(reverse)
+            , unanchored(!reverse)
+            , all(program->members > 0)
+            , restart(program->code.size())
+            , stride(program->classes + 1 + (sizeof(nrex_point) > 1 ? NREX_DFA_WIDE_CLASSES : 0))
+            , limit(NREX_DFA_CACHE_SIZE / int(sizeof(int) * stride))
+            , capacity(16)
+            , table(NULL)
+            , hashes(NULL)
+            , hash_mask(0)
+            , resets(0)
+            , local(local)
+            , visited(program->code.size() + 1, take(local, (program->code.size() + 1) * 2))
+            , added(program->code.size() + 1, take(local, (program->code.size() + 1) * 2))
+            , wide_words(0)
+            , wide_count(0)
+            , reset_pos(0)
+            , thrash(0)
+            , failed(false)
+            , streaming(false)
+        {
+            if (limit < 16)
+            {
+                limit = 16;
+            }
+            if (local)
+            {
+                local->lend(states, capacity);
+                local->lend(pool, capacity * 2);
+                local->lend(stack, restart + 1);
+                local->lend(closure, restart + 1);
+                local->lend(kernel, restart + 1);
+                local->lend(marks, program->registers);
+            }
+            marks.resize(program->registers);
+            for (int i = 0; i < program->registers; ++i)
+            {
+                marks[i] = 0;
+            }
+            grow();
+            clear();
+        }
+
+        ~nrex_dfa()
+        {
+            drop(table);
+            drop(hashes);
+        }
+
+        static int* take(nrex_local_memory* local, int count)
+        {
+            return local ? static_cast<int*>(local->take(count * sizeof(int))) : NULL;
+        }
+
+        int* allocate(int count)
+        {
+            int* block = take(local, count);
+            return block ? block : NREX_NEW_ARRAY(int, count);
+        }
+
+        void drop(int* block)
+        {
+            if (block && !(local && local->owns(block)))
+            {
+                NREX_DELETE_ARRAY(block);
+            }
+        }
+
+        void bind(const nrex_char* str, int end)
+        {
+            this->str = str;
+            this->end = end;
+            reset_pos = 0;
+            thrash = 0;
+            failed = false;
+        }
+
+        unsigned int hash(const int* list, int count, int flags) const
+        {
+            unsigned int result = 2166136261u ^ (unsigned int)flags;
+            for (int i = 0; i < count; ++i)
+            {
+                result = (result ^ (unsigned int)list[i]) * 16777619u;
+            }
+            return result;
+        }
+
+        void grow()
+        {
+            if (table)
+            {
+                capacity *= 2;
+                if (capacity > limit)
+                {
+                    capacity = limit;
+                }
+            }
+            int* old = table;
+            table = allocate(capacity * stride);
+            for (int i = 0; old && i < (int)states.size() * stride; ++i)
+            {
+                table[i] = old[i];
+            }
+            if (old)
+            {
+                drop(old);
+                drop(hashes);
+            }
+            hash_mask = 1;
+            while (hash_mask < capacity * 2)
+            {
+                hash_mask <<= 1;
+            }
+            --hash_mask;
+            hashes = allocate(hash_mask + 1);
+            for (int i = 0; i <= hash_mask; ++i)
+            {
+                hashes[i] = 0;
+            }
+            for (unsigned int i = 0; i < states.size(); ++i)
+            {
+                const nrex_dfa_state& state = states[i];
+                const int* list = state.count ? &pool[state.kernel] : NULL;
+                int slot = int(hash(list, state.count, state.flags) & (unsigned int)hash_mask);
+                while (hashes[slot])
+                {
+                    slot = (slot + 1) & hash_mask;
+                }
+                hashes[slot] = i + 1;
+            }
+        }
+
+        void clear()
+        {
+            ++resets;
+            states.clear();
+            pool.clear();
+            for (int i = 0; i <= hash_mask; ++i)
+            {
+                hashes[i] = 0;
+            }
+            intern(NULL, 0, 0);
+            if (unanchored)
+            {
+                for (int flags = 0; flags < 4; ++flags)
+                {
+                    intern(&restart, 1, flags);
+                }
+            }
+        }
+
+        int intern(const int* list, int count, int flags)
+        {
+            if (count == 0 && states.size() > 0)
+            {
+                return 0;
+            }
+            int slot = int(hash(list, count, flags) & (unsigned int)hash_mask);
+            while (hashes[slot])
+            {
+                const nrex_dfa_state& state = states[hashes[slot] - 1];
+                if (state.flags == flags && state.count == count)
+                {
+                    bool same = true;
+                    for (int i = 0; i < count && same; ++i)
+                    {
+                        same = (pool[state.kernel + i] == list[i]);
+                    }
+                    if (same)
+                    {
+                        return hashes[slot] - 1;
+                    }
+                }
+                slot = (slot + 1) & hash_mask;
+            }
+            if ((int)states.size() >= capacity)
+            {
+                if (capacity >= limit)
+                {
+                    return -1;
+                }
+                grow();
+                return intern(list, count, flags);
+            }
+            nrex_dfa_state state;
+            state.kernel = pool.size();
+            state.count = count;
+            state.flags = flags;
+            state.accepts = 0;
+            for (int i = 0; i < count; ++i)
+            {
+                pool.push(list[i]);
+                if (list[i] < restart && program->code[list[i]].op == nrex_op_match)
+                {
+                    ++state.accepts;
+                }
+            }
+            int index = states.size();
+            states.push(state);
+            for (int i = 0; i < stride; ++i)
+            {
+                table[index * stride + i] = -1;
+            }
+            hashes[slot] = index + 1;
+            return index;
+        }
+
+        int start(int pos)
+        {
+            int flags = 0;
+            if (reverse)
+            {
+                if (nrex_word_after(str, pos, end))
+                {
+                    flags |= NREX_DFA_BEHIND_WORD;
+                }
+                if (pos == end)
+                {
+                    flags |= NREX_DFA_ORIGIN;
+                }
+                int first = 0;
+                return intern(&first, 1, flags);
+            }
+            if (nrex_word_before(str, pos))
+            {
+                flags |= NREX_DFA_BEHIND_WORD;
+            }
+            if (pos == 0)
+            {
+                flags |= NREX_DFA_ORIGIN;
+            }
+            return 1 + flags;
+        }
+
+        bool expand(int pc, int flags, bool ahead_word, bool terminal)
+        {
+            stack.push(pc);
+            while (stack.size() > 0)
+            {
+                pc = stack.top();
+                stack.pop();
+                if (pc < 0)
+                {
+                    marks[~pc >> 1] = ~pc & 1;
+                    continue;
+                }
+                bool follow = true;
+                while (follow && visited.insert(pc))
+                {
+                    const nrex_inst& inst = program->code[pc];
+                    switch (inst.op)
+                    {
+                        case nrex_op_jump:
+                            pc = inst.x;
+                            break;
+                        case nrex_op_split:
+                            stack.push(inst.y);
+                            pc = inst.x;
+                            break;
+                        case nrex_op_save:
+                            if (inst.x >= program->slots)
+                            {
+                                stack.push(~(inst.x * 2 + marks[inst.x]));
+                                marks[inst.x] = 1;
+                            }
+                            ++pc;
+                            break;
+                        case nrex_op_progress:
+                            pc = marks[inst.x] ? inst.y : pc + 1;
+                            break;
+                        case nrex_op_anchor_start:
+                            follow = reverse ? terminal : (flags & NREX_DFA_ORIGIN) != 0;
+                            ++pc;
+                            break;
+                        case nrex_op_anchor_end:
+                            follow = reverse ? (flags & NREX_DFA_ORIGIN) != 0 : terminal;
+                            ++pc;
+                            break;
+                        case nrex_op_word_boundary:
+                        {
+                            bool behind_word = (flags & NREX_DFA_BEHIND_WORD) != 0;
+                            follow = ((behind_word != ahead_word) != (inst.x != 0));
+                            ++pc;
+                            break;
+                        }
+                        case nrex_op_match:
+                            if (!reverse && !all)
+                            {
+                                while (stack.size() > 0)
+                                {
+                                    if (stack.top() < 0)
+                                    {
+                                        marks[~stack.top() >> 1] = ~stack.top() & 1;
+                                    }
+                                    stack.pop();
+                                }
+                                return true;
+                            }
+                            closure.push(pc);
+                            follow = false;
+                            break;
+                        default:
+                            closure.push(pc);
+                            follow = false;
+                            break;
+                    }
+                }
+            }
+            return false;
+        }
+
+        int compute(int index, nrex_point c, bool terminal, int pos)
+        {
+            nrex_dfa_state state = states[index];
+            bool ahead_word = !terminal && nrex_is_word(c);
+            bool matched = false;
+            visited.size = 0;
+            closure.clear();
+            for (int i = 0; i < state.count && !matched; ++i)
+            {
+                int pc = pool[state.kernel + i];
+                if (pc == restart)
+                {
+                    matched = expand(0, state.flags, ahead_word, terminal);
+                    if (!matched)
+                    {
+                        closure.push(restart);
+                    }
+                }
+                else
+                {
+                    matched = expand(pc, state.flags, ahead_word, terminal);
+                }
+            }
+            for (unsigned int i = 0; i < closure.size() && (reverse || all); ++i)
+            {
+                if (closure[i] != restart && program->code[closure[i]].op == nrex_op_match)
+                {
+                    matched = true;
+                }
+            }
+            if (terminal)
+            {
+                return matched ? 1 : 0;
+            }
+            added.size = 0;
+            kernel.clear();
+            for (unsigned int i = 0; i < closure.size(); ++i)
+            {
+                int pc = closure[i];
+                if (pc == restart)
+                {
+                    if (added.insert(restart))
+                    {
+                        kernel.push(restart);
+                    }
+                }
+                else if (all && program->code[pc].op == nrex_op_match)
+                {
+                    if (added.insert(pc))
+                    {
+                        kernel.push(pc);
+                    }
+                }
+                else if (nrex_consume(program, program->code[pc], c) && added.insert(pc + 1))
+                {
+                    kernel.push(pc + 1);
+                }
+            }
+            int flags = nrex_is_word(c) ? NREX_DFA_BEHIND_WORD : 0;
+            int next = (kernel.size() > 0) ? intern(&kernel[0], kernel.size(), flags) : 0;
+            if (next < 0)
+            {
+                // A stream has nothing to fall back on, so it keeps
+                // rebuilding the cache instead of giving up.
+                if (!streaming && pos - reset_pos < 10 * limit && ++thrash > 3)
+                {
+                    failed = true;
+                    return -1;
+                }
+                reset_pos = pos;
+                clear();
+                next = intern(&kernel[0], kernel.size(), flags);
+            }
+            return (next << 1) | (matched ? 1 : 0);
+        }
+
+        // Two characters step every state the same way if they agree on
+        // being a word character and on each instruction that takes one.
+        int wide_class(nrex_point c)
+        {
+            if (wide_points.size() == 0)
+            {
+                if (local)
+                {
+                    local->lend(consumers, restart);
+                    local->lend(wide_points, NREX_DFA_WIDE_CACHE);
+                    local->lend(wide_ids, NREX_DFA_WIDE_CACHE);
+                }
+                for (unsigned int pc = 0; pc < program->code.size(); ++pc)
+                {
+                    if (nrex_op_char <= program->code[pc].op && program->code[pc].op <= nrex_op_bracket)
+                    {
+                        consumers.push(pc);
+                    }
+                }
+                wide_words = (consumers.size() + 32) / 32;
+                if (local)
+                {
+                    local->lend(wide_bits, wide_words * (NREX_DFA_WIDE_CLASSES + 1));
+                }
+                wide_bits.resize(wide_words * (NREX_DFA_WIDE_CLASSES + 1));
+                wide_points.resize(NREX_DFA_WIDE_CACHE);
+                wide_ids.resize(NREX_DFA_WIDE_CACHE);
+                for (int i = 0; i < NREX_DFA_WIDE_CACHE; ++i)
+                {
+                    wide_points[i] = 0;
+                }
+            }
+            int slot = int(((unsigned int)c * 2654435761u) >> 24) & (NREX_DFA_WIDE_CACHE - 1);
+            if (wide_points[slot] == c)
+            {
+                return wide_ids[slot];
+            }
+            unsigned int* bits = &wide_bits[wide_count * wide_words];
+            for (int i = 0; i < wide_words; ++i)
+            {
+                bits[i] = 0;
+            }
+            bits[0] = nrex_is_word(c) ? 1 : 0;
+            for (unsigned int i = 0; i < consumers.size(); ++i)
+            {
+                if (nrex_consume(program, program->code[consumers[i]], c))
+                {
+                    bits[(i + 1) / 32] |= 1u << ((i + 1) % 32);
+                }
+            }
+            int id = 0;
+            while (id < wide_count && memcmp(&wide_bits[id * wide_words], bits, wide_words * sizeof(unsigned int)) != 0)
+            {
+                ++id;
+            }
+            if (id == wide_count)
+            {
+                // Past the last column the bits are scratch space only.
+                if (wide_count < NREX_DFA_WIDE_CLASSES)
+                {
+                    ++wide_count;
+                }
+                else
+                {
+                    id = -1;
+                }
+            }
+            wide_points[slot] = c;
+            wide_ids[slot] = id;
+            return id;
+        }
+
+        int step(int index, nrex_point c, int pos)
+        {
+            int entry = index * stride + program->classmap[(unsigned char)c];
+            if ((unsigned int)c > 0xFF && sizeof(nrex_point) > 1)
+            {
+                int id = wide_class(c);
+                if (id < 0)
+                {
+                    return compute(index, c, false, pos);
+                }
+                entry = index * stride + program->classes + 1 + id;
+            }
+            if (table[entry] < 0)
+            {
+                int generation = resets;
+                int result = compute(index, c, false, pos);
+                if (result >= 0 && generation == resets)
+                {
+                    table[entry] = result;
+                }
+                return result;
+            }
+            return table[entry];
+        }
+
+        int finish(int index, int pos)
+        {
+            int entry = index * stride + program->classes;
+            if (table[entry] < 0)
+            {
+                table[entry] = compute(index, 0, true, pos);
+            }
+            return table[entry];
+        }
+
+        int forward(int pos, bool earliest)
+        {
+            bool prefilter = (program->first || program->prefixes || program->literal || program->anchor_start || program->anchor_end >= 0);
+            int state = start(pos);
+            int found = -1;
+            int hit = -1;
+            while (true)
+            {
+                if (state <= 4 && prefilter)
+                {
+                    int next = program->candidate(str, pos, end, &hit);
+                    if (next < 0)
+                    {
+                        break;
+                    }
+                    if (next != pos)
+                    {
+                        pos = next;
+                        state = start(pos);
+                    }
+                }
+                if (pos >= end)
+                {
+                    if (finish(state, pos) & 1)
+                    {
+                        found = pos;
+                    }
+                    break;
+                }
+                nrex_point c;
+                int after = nrex_next(str, pos, end, &c);
+                int result = step(state, c, pos);
+                if (result < 0)
+                {
+                    return -1;
+                }
+                if (result & 1)
+                {
+                    found = pos;
+                    if (earliest)
+                    {
+                        break;
+                    }
+                }
+                state = result >> 1;
+                if (state == 0)
+                {
+                    break;
+                }
+                pos = after;
+            }
+            return found;
+        }
+
+        int backward(int pos, int offset)
+        {
+            int state = start(pos);
+            int found = -1;
+            while (true)
+            {
+                if (pos == 0)
+                {
+                    if (finish(state, pos) & 1)
+                    {
+                        found = pos;
+                    }
+                    break;
+                }
+                nrex_point c;
+                int before = nrex_prev(str, pos, &c);
+                int result = step(state, c, end - pos);
+                if (result < 0)
+                {
+                    return -1;
+                }
+                if (result & 1)
+                {
+                    found = pos;
+                }
+                state = result >> 1;
+                if (state == 0 || pos == offset)
+                {
+                    break;
+                }
+                if (before < offset)
+                {
+                    // The offset falls inside a character read whole from
+                    // this side, so a start there can't be told apart.
+                    failed = true;
+                    return -1;
+                }
+                pos = before;
+            }
+            return found;
+        }
+
+        bool scan(int pos, bool* matched)
+        {
+            int state = start(pos);
+            while (pos < end && states[state].accepts < program->members)
+            {
+                nrex_point c;
+                int after = nrex_next(str, pos, end, &c);
+                int result = step(state, c, pos);
+                if (result < 0)
+                {
+                    return false;
+                }
+                state = result >> 1;
+                pos = after;
+            }
+            const nrex_dfa_state& accepted = states[state];
+            for (int i = 0; i < accepted.count; ++i)
+            {
+                int pc = pool[accepted.kernel + i];
+                if (pc < restart && program->code[pc].op == nrex_op_match)
+                {
+                    matched[program->code[pc].x] = true;
+                }
+            }
+            if (pos == end)
+            {
+                compute(state, 0, true, pos);
+                for (unsigned int i = 0; i < closure.size(); ++i)
+                {
+                    int pc = closure[i];
+                    if (pc < restart && program->code[pc].op == nrex_op_match)
+                    {
+                        matched[program->code[pc].x] = true;
+                    }
+                }
+            }
+            return true;
+        }
+};
+
+struct nrex_scratch
+{
+        const nrex_program* program;
+        unsigned int signature;
+        nrex_array<int> regs;
+        nrex_array<nrex_result> results;
+        nrex_array<nrex_backtrack_entry> stack;
+        nrex_budget budget;
+        nrex_array<unsigned int> visited;
+        nrex_pike_level* levels;
+        nrex_pike_level base;
+        nrex_dfa* forward;
+        nrex_dfa* backward;
+        bool transient;
+        nrex_local_memory local;
+#ifdef NREX_INSTRUMENT
+        nrex_counters counters;
+#endif
+
+        nrex_scratch()
+            : program(NULL)
+            , signature(0)
+            , levels(NULL)
+            , forward(NULL)
+            , backward(NULL)
+            , transient(false)
+        {
+        }
+
+        ~nrex_scratch()
+        {
+            release();
+        }
+
+        void release()
+        {
+            if (levels && levels != &base)
+            {
+                NREX_DELETE_ARRAY(levels);
+            }
+            base.clear();
+            drop(forward);
+            drop(backward);
+            if (local.data)
+            {
+                // Nothing may keep pointing into the buffer once it is
+                // handed out again.
+                regs.borrow(NULL, 0);
+                results.borrow(NULL, 0);
+                stack.borrow(NULL, 0);
+                base.stack.borrow(NULL, 0);
+                local.used = 0;
+            }
+            levels = NULL;
+            forward = NULL;
+            backward = NULL;
+            program = NULL;
+        }
+
+        void bind(const nrex_program* p)
+        {
+            budget.steps = 0;
+            budget.aborted = false;
+            if (program != p || signature != p->signature)
+            {
+                release();
+                program = p;
+                signature = p->signature;
+                NREX_COUNT(counters.clear(p->code.size()));
+                local.lend(regs, p->registers);
+                if (p->backtrack)
+                {
+                    local.lend(stack, p->code.size() * 4);
+                }
+            }
+        }
+
+        void drop(nrex_dfa* dfa)
+        {
+            if (dfa && local.owns(dfa))
+            {
+                dfa->~nrex_dfa();
+            }
+            else if (dfa)
+            {
+                NREX_DELETE(dfa);
+            }
+        }
+
+        int* registers()
+        {
+            regs.resize(program->registers);
+            for (int i = 0; i < program->registers; ++i)
+            {
+                regs[i] = -1;
+            }
+            return &regs[0];
+        }
+
+        nrex_pike_level* pike_levels()
+        {
+            if (!levels)
+            {
+                levels = (program->depth == 0) ? &base : NREX_NEW_ARRAY(nrex_pike_level, program->depth + 1);
+                int count = program->code.size();
+                void* block = local.take(nrex_pike_level::footprint(count, program->registers) * sizeof(int));
+                if (block)
+                {
+                    levels[0].init(count, program->registers, static_cast<int*>(block));
+                    local.lend(levels[0].stack, count + 1);
+                }
+            }
+            return levels;
+        }
+
+        nrex_dfa* dfa(bool reverse, const nrex_char* str, int end)
+        {
+            nrex_dfa*& dfa = reverse ? backward : forward;
+            if (!dfa && transient)
+            {
+                // The DFAs of a call made without a nrex_match_context go
+                // in its buffer as well, as long as there is room.
+                void* memory = local.take(sizeof(nrex_dfa));
+                const nrex_program* source = reverse ? program->reverse : program;
+                dfa = memory ? new (memory) nrex_dfa(source, reverse, &local) : NREX_NEW(nrex_dfa(source, reverse, &local));
+            }
+            else if (!dfa)
+            {
+                dfa = NREX_NEW(nrex_dfa(reverse ? program->reverse : program, reverse));
+            }
+            dfa->bind(str, end);
+            return dfa;
+        }
+};
+
+#ifndef NREX_LOCAL_STORAGE
+#define NREX_LOCAL_STORAGE 8192
+#endif
+
+// Working memory for a call made without a nrex_match_context. It is
+// thrown away when the call returns, and patterns without lookahead whose
+// NFA and DFAs fit in the buffer run without touching the heap.
+struct nrex_local_scratch : public nrex_scratch
+{
+        nrex_arena_align buffer[NREX_LOCAL_STORAGE / sizeof(nrex_arena_align)];
+
+        nrex_local_scratch()
+        {
+            transient = true;
+            local.data = reinterpret_cast<char*>(buffer);
+            local.size = sizeof(buffer);
+        }
+};
+
+bool nrex_has_lookbehind(nrex_array<nrex_node_group*>& stack)
+{
+    for (unsigned int i = 0; i < stack.size(); i++)
+    {
+        if (stack[i]->type == nrex_group_look_behind)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static nrex_node* nrex_required_literal(nrex_node_group* root, int* length, int* offset)
+{
+    nrex_node* best = NULL;
+    *length = 0;
+    *offset = -1;
+    if (root->childset.size() != 1)
+    {
+        return NULL;
+    }
+    nrex_node* run = NULL;
+    int run_length = 0;
+    int run_offset = -1;
+    int distance = 0;
+    for (nrex_node* node = root->childset[0]; ; node = node->next)
+    {
+        nrex_point c;
+        if (node && node->literal(&c))
+        {
+            if (!run)
+            {
+                run = node;
+                run_length = 0;
+                run_offset = distance;
+            }
+            ++run_length;
+        }
+        else if (run)
+        {
+            bool fixed = (run_offset >= 0);
+            bool best_fixed = (*offset >= 0);
+            if (!best || fixed > best_fixed || (fixed == best_fixed && run_length > *length))
+            {
+                best = run;
+                *length = run_length;
+                *offset = run_offset;
+            }
+            run = NULL;
+        }
+        if (!node)
+        {
+            break;
+        }
+        int width = node->width();
+        distance = (distance >= 0 && width >= 0) ? distance + width : -1;
+    }
+    return best;
+}
+
+nrex::nrex()
+    : _capturing(0)
+    , _program(NULL)
+{
+}
+
+nrex::nrex(const nrex_char* pattern, int captures)
+    : _capturing(0)
+    , _program(NULL)
+{
+    compile(pattern, captures);
+}
+
+nrex::~nrex()
+{
+    if (_program)
+    {
+        NREX_DELETE(_program);
+    }
+}
+
+bool nrex::valid() const
+{
+    return (_program != NULL);
+}
+
+void nrex::reset()
+{
+    _capturing = 0;
+    if (_program)
+    {
+        NREX_DELETE(_program);
+    }
+    _program = NULL;
+}
+
+int nrex::capture_size() const
+{
+    if (_program)
+    {
+        return _capturing + 1;
+    }
+    return 0;
+}
+
+// Allocates a node in the arena of the pattern being compiled.
+#define NREX_NEW_NODE(X) new (&arena) X
+
+bool nrex::compile(const nrex_char* pattern, int captures)
+{
+    reset();
+    nrex_arena arena;
+    nrex_node_group* root = NREX_NEW_NODE(nrex_node_group(&arena, nrex_group_capture, _capturing));
+    nrex_array<nrex_node_group*> stack;
+    stack.push(root);
+
+    for (const nrex_char* c = pattern; c[0] != '\0'; ++c)
+    {
+#ifdef NREX_INSTRUMENT
+        int token = c - pattern;
+#endif
+        if (c[0] == '(')
+        {
+            if (c[1] == '?')
+            {
+                if (c[2] == ':')
+                {
+                    c = &c[2];
+                    nrex_node_group* group = NREX_NEW_NODE(nrex_node_group(&arena, nrex_group_non_capture));
+                    stack.top()->add_child(group);
+                    stack.push(group);
+                }
+                else if (c[2] == '>')
+                {
+                    c = &c[2];
+                    nrex_node_group* group = NREX_NEW_NODE(nrex_node_group(&arena, nrex_group_atomic));
+                    stack.top()->add_child(group);
+                    stack.push(group);
+                }
+                else if (c[2] == '!' || c[2] == '=')
+                {
+                    c = &c[2];
+                    nrex_node_group* group = NREX_NEW_NODE(nrex_node_group(&arena, nrex_group_look_ahead));
+                    group->negate = (c[0] == '!');
+                    stack.top()->add_child(group);
+                    stack.push(group);
+                }
+                else if (c[2] == '<' && (c[3] == '!' || c[3] == '='))
+                {
+                    c = &c[3];
+                    nrex_node_group* group = NREX_NEW_NODE(nrex_node_group(&arena, nrex_group_look_behind));
+                    group->negate = (c[0] == '!');
+                    stack.top()->add_child(group);
+                    stack.push(group);
+                }
+                else
+                {
+                    NREX_COMPILE_ERROR("unrecognised qualifier for group");
+                }
+            }
+            else if (captures >= 0 && _capturing < captures && _capturing < INT_MAX)
+            {
+                nrex_node_group* group = NREX_NEW_NODE(nrex_node_group(&arena, nrex_group_capture, ++_capturing));
+                stack.top()->add_child(group);
+                stack.push(group);
+            }
+            else
+            {
+                nrex_node_group* group = NREX_NEW_NODE(nrex_node_group(&arena, nrex_group_non_capture));
+                stack.top()->add_child(group);
+                stack.push(group);
+            }
+        }
+        else if (c[0] == ')')
+        {
+            if (stack.size() > 1)
+            {
+                stack.pop();
+            }
+            else
+            {
+                NREX_COMPILE_ERROR("unexpected ')'");
+            }
+        }
+        else if (c[0] == '[')
+        {
+            nrex_node_group* group = NREX_NEW_NODE(nrex_node_group(&arena, nrex_group_bracket));
+            stack.top()->add_child(group);
+            if (c[1] == '^')
+            {
+                group->negate = true;
+                ++c;
+            }
+            bool first_child = true;
+            nrex_point previous_child = 0;
+            bool previous_child_single = false;
+            while (true)
+            {
+                group->add_childset();
+                ++c;
+                if (c[0] == '\0')
+                {
+                    NREX_COMPILE_ERROR("unclosed bracket expression '['");
+                }
+                if (c[0] == '[' && c[1] == ':')
+                {
+                    const nrex_char* d = &c[2];
+                    nrex_class_type cls = nrex_parse_class(&d);
+                    if (cls != nrex_class_none)
+                    {
+                        c = d;
+                        group->add_child(NREX_NEW_NODE(nrex_node_class(cls)));
+                        previous_child_single = false;
+                    }
+                    else
+                    {
+                        group->add_child(NREX_NEW_NODE(nrex_node_char('[')));
+                        previous_child = '[';
+                        previous_child_single = true;
+                    }
+                }
+                else if (c[0] == ']' && !first_child)
+                {
+                    break;
+                }
+                else if (c[0] == '\\')
+                {
+                    if (nrex_is_shorthand(c[1]))
+                    {
+                        group->add_child(NREX_NEW_NODE(nrex_node_shorthand(c[1])));
+                        ++c;
+                        previous_child_single = false;
+                    }
+                    else
+                    {
+                        const nrex_char* d = c;
+                        nrex_point unescaped = nrex_unescape(d);
+                        if (c == d)
+                        {
+                            NREX_COMPILE_ERROR("invalid escape token");
+                        }
+                        group->add_child(NREX_NEW_NODE(nrex_node_char(unescaped)));
+                        c = d;
+                        previous_child = unescaped;
+                        previous_child_single = true;
+                    }
+                }
+                else if (previous_child_single && c[0] == '-')
+                {
+                    bool is_range = false;
+                    nrex_point next;
+                    if (c[1] != '\0' && c[1] != ']')
+                    {
+                        if (c[1] == '\\')
+                        {
+                            const nrex_char* d = ++c;
+                            next = nrex_unescape(d);
+                            if (c == d)
+                            {
+                                NREX_COMPILE_ERROR("invalid escape token in range");
+                            }
+                        }
+                        else if (!nrex_read_point(++c, &next))
+                        {
+                            NREX_COMPILE_ERROR("invalid UTF-8 in pattern");
+                        }
+                        is_range = true;
+                    }
+                    if (is_range)
+                    {
+                        if (next < previous_child)
+                        {
+                            NREX_COMPILE_ERROR("text range out of order");
+                        }
+                        group->pop_back();
+                        group->add_child(NREX_NEW_NODE(nrex_node_range(previous_child, next)));
+                        previous_child_single = false;
+                    }
+                    else
+                    {
+                        group->add_child(NREX_NEW_NODE(nrex_node_char(c[0])));
+                        previous_child = c[0];
+                        previous_child_single = true;
+                    }
+                }
+                else
+                {
+                    nrex_point point;
+                    if (!nrex_read_point(c, &point))
+                    {
+                        NREX_COMPILE_ERROR("invalid UTF-8 in pattern");
+                    }
+                    group->add_child(NREX_NEW_NODE(nrex_node_char(point)));
+                    previous_child = point;
+                    previous_child_single = true;
+                }
+                first_child = false;
+            }
+        }
+        else if (nrex_is_quantifier(c[0]))
+        {
+            int min = 0;
+            int max = -1;
+            bool valid_quantifier = true;
+            if (c[0] == '?')
+            {
+                min = 0;
+                max = 1;
+            }
+            else if (c[0] == '+')
+            {
+                min = 1;
+                max = -1;
+            }
+            else if (c[0] == '*')
+            {
+                min = 0;
+                max = -1;
+            }
+            else if (c[0] == '{')
+            {
+                bool max_set = false;
+                const nrex_char* d = c;
+                while (true)
+                {
+                    ++d;
+                    if (d[0] == '\0')
+                    {
+                        valid_quantifier = false;
+                        break;
+                    }
+                    else if (d[0] == '}')
+                    {
+                        break;
+                    }
+                    else if (d[0] == ',')
+                    {
+                        max_set = true;
+                        continue;
+                    }
+                    else if (d[0] < '0' || '9' < d[0])
+                    {
+                        valid_quantifier = false;
+                        break;
+                    }
+                    if (max_set)
+                    {
+                        if (max < 0)
+                        {
+                            max = int(d[0] - '0');
+                        }
+                        else
+                        {
+                            max = max * 10 + int(d[0] - '0');
+                        }
+                    }
+                    else
+                    {
+                        min = min * 10 + int(d[0] - '0');
+                    }
+                }
+                if (!max_set)
+                {
+                    max = min;
+                }
+                if (valid_quantifier)
+                {
+                    c = d;
+                }
+            }
+            if (valid_quantifier)
+            {
+                if (stack.top()->back == NULL || !stack.top()->back->quantifiable)
+                {
+                    NREX_COMPILE_ERROR("element not quantifiable");
+                }
+                nrex_node_quantifier* quant = NREX_NEW_NODE(nrex_node_quantifier(min, max));
+                if (min == max)
+                {
+                    if (stack.top()->back->length >= 0)
+                    {
+                        quant->length = max * stack.top()->back->length;
+                    }
+                }
+                else
+                {
+                    if (nrex_has_lookbehind(stack))
+                    {
+                        NREX_COMPILE_ERROR("variable length quantifiers inside lookbehind not supported");
+                    }
+                }
+                quant->child = stack.top()->swap_back(quant);
+                quant->child->previous = NULL;
+                quant->child->next = NULL;
+                quant->child->parent = quant;
+#ifdef NREX_INSTRUMENT
+                quant->source_begin = quant->child->source_begin;
+#endif
+                if (c[1] == '?')
+                {
+                    quant->greedy = false;
+                    ++c;
+                }
+                else if (c[1] == '+')
+                {
+                    quant->possessive = true;
+                    ++c;
+                }
+            }
+            else
+            {
+                stack.top()->add_child(NREX_NEW_NODE(nrex_node_char(c[0])));
+            }
+        }
+        else if (c[0] == '|')
+        {
+            if (nrex_has_lookbehind(stack))
+            {
+                NREX_COMPILE_ERROR("alternations inside lookbehind not supported");
+            }
+            stack.top()->add_childset();
+        }
+        else if (c[0] == '^' || c[0] == '$')
+        {
+            stack.top()->add_child(NREX_NEW_NODE(nrex_node_anchor((c[0] == '$'))));
+        }
+        else if (c[0] == '.')
+        {
+            stack.top()->add_child(NREX_NEW_NODE(nrex_node_shorthand('.')));
+        }
+        else if (c[0] == '\\')
+        {
+            if (nrex_is_shorthand(c[1]))
+            {
+                stack.top()->add_child(NREX_NEW_NODE(nrex_node_shorthand(c[1])));
+                ++c;
+            }
+            else if (('1' <= c[1] && c[1] <= '9') || (c[1] == 'g' && c[2] == '{'))
+            {
+                int ref = 0;
+                bool unclosed = false;
+                if (c[1] == 'g')
+                {
+                    unclosed = true;
+                    c = &c[2];
+                }
+                while ('0' <= c[1] && c[1] <= '9')
+                {
+                    ref = ref * 10 + int(c[1] - '0');
+                    ++c;
+                }
+                if (c[1] == '}')
+                {
+                    unclosed = false;
+                    ++c;
+                }
+                if (ref > _capturing || ref <= 0 || unclosed)
+                {
+                    NREX_COMPILE_ERROR("backreference to non-existent capture");
+                }
+                if (nrex_has_lookbehind(stack))
+                {
+                    NREX_COMPILE_ERROR("backreferences inside lookbehind not supported");
+                }
+                stack.top()->add_child(NREX_NEW_NODE(nrex_node_backreference(ref)));
+            }
+            else if (c[1] == 'b' || c[1] == 'B')
+            {
+                stack.top()->add_child(NREX_NEW_NODE(nrex_node_word_boundary(c[1] == 'B')));
+                ++c;
+            }
+            else
+            {
+                const nrex_char* d = c;
+                nrex_point unescaped = nrex_unescape(d);
+                if (c == d)
+                {
+                    NREX_COMPILE_ERROR("invalid escape token");
+                }
+                stack.top()->add_child(NREX_NEW_NODE(nrex_node_char(unescaped)));
+                c = d;
+            }
+        }
+        else
+        {
+            nrex_point point;
+            if (!nrex_read_point(c, &point))
+            {
+                NREX_COMPILE_ERROR("invalid UTF-8 in pattern");
+            }
+            stack.top()->add_child(NREX_NEW_NODE(nrex_node_char(point)));
+        }
+#ifdef NREX_INSTRUMENT
+        nrex_node* node = (pattern[token] == '(') ? stack.top() : stack.top()->back;
+        if (node)
+        {
+            if (node->source_begin < 0)
+            {
+                node->source_begin = token;
+            }
+            node->source_end = c - pattern + 1;
+        }
+#endif
+    }
+    if (stack.size() > 1)
+    {
+        NREX_COMPILE_ERROR("unclosed group '('");
+    }
+    root->optimize(&arena);
+    nrex_program* program = NREX_NEW(nrex_program(_capturing));
+    _program = program;
+#ifdef NREX_INSTRUMENT
+    int pattern_length = NREX_STRLEN(pattern);
+    root->source_begin = 0;
+    root->source_end = pattern_length;
+    for (int i = 0; i < pattern_length; ++i)
+    {
+        program->pattern.push(pattern[i]);
+    }
+#endif
+    root->lower_node(program);
+    program->emit(nrex_op_match);
+    if (!program->pike)
+    {
+        program->code.clear();
+        program->items.clear();
+        program->registers = program->slots;
+        program->backtrack = true;
+        root->lower_node(program);
+        program->emit(nrex_op_match);
+    }
+    nrex_build_brackets(program);
+    if (program->backtrack)
+    {
+        nrex_build_runs(program);
+    }
+    if (program->pike && program->depth == 0)
+    {
+        nrex_build_classes(program);
+        program->reverse = NREX_NEW(nrex_program(_capturing));
+        program->reverse->backward = true;
+        root->lower_node(program->reverse);
+        program->reverse->emit(nrex_op_match);
+        nrex_build_brackets(program->reverse);
+        nrex_build_classes(program->reverse);
+    }
+    int literal_count = 0;
+    nrex_node* literal = nrex_required_literal(root, &literal_count, &program->literal_offset);
+    if (literal)
+    {
+        nrex_char bytes[4];
+        nrex_array<nrex_char> chars;
+        for (int i = 0; i < literal_count; ++i, literal = literal->next)
+        {
+            nrex_point c;
+            literal->literal(&c);
+            for (int j = 0, n = nrex_encode(c, bytes); j < n; ++j)
+            {
+                chars.push(bytes[j]);
+            }
+        }
+        program->literal_length = chars.size();
+        program->literal = NREX_NEW_ARRAY(nrex_char, program->literal_length);
+        for (int i = 0; i < program->literal_length; ++i)
+        {
+            program->literal[i] = chars[i];
+        }
+    }
+    if (program->literal_offset != 0)
+    {
+        nrex_charset* first = NREX_NEW(nrex_charset);
+        if (!root->first(first) && !first->full())
+        {
+            first->prepare();
+            program->first = first;
+        }
+        else
+        {
+            NREX_DELETE(first);
+        }
+    }
+    nrex_literals* prefixes = NREX_NEW(nrex_literals);
+    if (!program->literal && root->prefixes(prefixes) && prefixes->useful())
+    {
+        prefixes->build();
+        program->prefixes = prefixes;
+    }
+    else
+    {
+        NREX_DELETE(prefixes);
+    }
+    program->anchor_start = root->anchored_start();
+    if (root->anchored_end())
+    {
+        program->anchor_end = root->width();
+        program->anchored_end = true;
+    }
+    program->pack();
+    program->signature = program->digest();
+    program->memo = program->memoizable();
+    return true;
+}
+
+int nrex::serialize(void* buffer, int size) const
+{
+    if (!_program)
+    {
+        return 0;
+    }
+    nrex_writer writer(buffer, size);
+    writer.put("NREX", 4);
+    writer.put_int(NREX_BLOB_VERSION);
+    writer.put_int(0x01020304);
+    writer.put_int(NREX_CHAR_KIND);
+    writer.put_int(sizeof(int));
+    writer.put_int(_capturing);
+    _program->write(&writer);
+    return writer.size;
+}
+
+bool nrex::load(const void* buffer, int size)
+{
+    reset();
+    if (!buffer || size < 0 || ((size_t)buffer & 3) != 0)
+    {
+        return false;
+    }
+    nrex_reader reader(buffer, size);
+    const void* magic = reader.take(4);
+    int version = reader.take_int();
+    int order = reader.take_int();
+    int char_size = reader.take_int();
+    int int_size = reader.take_int();
+    int capturing = reader.take_int();
+    if (reader.pos < 0 || memcmp(magic, "NREX", 4) != 0 || version != NREX_BLOB_VERSION || order != 0x01020304)
+    {
+        return false;
+    }
+    if (char_size != NREX_CHAR_KIND || int_size != (int)sizeof(int) || capturing < 0 || capturing >= INT_MAX / 2)
+    {
+        return false;
+    }
+    nrex_program* program = NREX_NEW(nrex_program(capturing));
+    if (!program->read(&reader) || program->slots != (capturing + 1) * 2)
+    {
+        NREX_DELETE(program);
+        return false;
+    }
+    program->signature = program->digest();
+    program->memo = program->memoizable();
+    _capturing = capturing;
+    _program = program;
+    return true;
+}
+
+nrex_match_context::nrex_match_context()
+    : _scratch(NREX_NEW(nrex_scratch))
+{
+}
+
+nrex_match_context::~nrex_match_context()
+{
+    NREX_DELETE(_scratch);
+}
+
+void nrex_match_context::reset()
+{
+    _scratch->release();
+}
+
+void nrex_match_context::set_step_limit(long steps)
+{
+    _scratch->budget.limit = steps;
+}
+
+void nrex_match_context::set_deadline(nrex_deadline_callback callback, void* data)
+{
+    _scratch->budget.deadline = callback;
+    _scratch->budget.data = data;
+}
+
+bool nrex_match_context::aborted() const
+{
+    return _scratch->budget.aborted;
+}
+
+long nrex_match_context::steps() const
+{
+    return _scratch->budget.steps;
+}
+
+#ifdef NREX_INSTRUMENT
+static const char* const nrex_op_names[] = {
+    "match", "char", "range", "class", "shorthand", "bracket", "split",
+    "jump", "save", "anchor_start", "anchor_end", "word_boundary",
+    "look_ahead", "look_behind", "look_end", "backreference", "atomic",
+    "span", "repeat_init", "repeat", "progress"
+};
+
+static void nrex_put_text(nrex_array<nrex_char>& text, const char* str, int width)
+{
+    int length = (int)strlen(str);
+    for (int i = 0; i < length; ++i)
+    {
+        text.push(nrex_char(str[i]));
+    }
+    for (int i = length; i < width; ++i)
+    {
+        text.push(nrex_char(' '));
+    }
+}
+
+static void nrex_put_number(nrex_array<nrex_char>& text, long number, int width)
+{
+    char digits[24];
+    int length = 0;
+    do
+    {
+        digits[length++] = char('0' + number % 10);
+        number /= 10;
+    }
+    while (number > 0);
+    for (int i = length; i < width; ++i)
+    {
+        text.push(nrex_char(' '));
+    }
+    while (length > 0)
+    {
+        text.push(nrex_char(digits[--length]));
+    }
+}
+
+int nrex_match_context::dump_stats(nrex_char* buffer, int size) const
+{
+    const nrex_program* program = _scratch->program;
+    if (!program)
+    {
+        return 0;
+    }
+    const nrex_counters& counters = _scratch->counters;
+    nrex_array<nrex_char> text;
+    nrex_put_text(text, "starts ", 0);
+    nrex_put_number(text, counters.starts, 0);
+    nrex_put_text(text, "\n    pc op                 visits     passes backtracks source\n", 0);
+    for (unsigned int pc = 0; pc < program->code.size(); ++pc)
+    {
+        nrex_put_number(text, pc, 6);
+        text.push(nrex_char(' '));
+        nrex_put_text(text, nrex_op_names[program->code[pc].op], 13);
+        nrex_put_number(text, counters.visits[pc], 11);
+        nrex_put_number(text, counters.passes[pc], 11);
+        nrex_put_number(text, counters.backtracks[pc], 11);
+        if (pc * 2 < program->sources.size() && program->sources[pc * 2] >= 0)
+        {
+            text.push(nrex_char(' '));
+            for (int i = program->sources[pc * 2]; i < program->sources[pc * 2 + 1]; ++i)
+            {
+                text.push(program->pattern[i]);
+            }
+        }
+        text.push(nrex_char('\n'));
+    }
+    text.push(nrex_char('\0'));
+    if (buffer && (int)text.size() <= size)
+    {
+        for (unsigned int i = 0; i < text.size(); ++i)
+        {
+            buffer[i] = text[i];
+        }
+    }
+    return text.size();
+}
+#endif
+
+// Finds the first match on the DFAs: the forward one gives its end and the
+// reverse one run back from there gives its start. Every match of a pattern
+// anchored at the end stops there, so only the reverse one is run and the
+// search takes time in the length of the match rather than the text.
+// Returns 1 with the span filled in, 0 if there is no match and -1 if
+// either DFA gave up.
+static int nrex_dfa_span(const nrex_program* program, const nrex_char* str, int offset, int end, nrex_scratch* scratch, nrex_result* span)
+{
+    int stop = end;
+    if (!program->anchored_end)
+    {
+        nrex_dfa* dfa = scratch->dfa(false, str, end);
+        stop = dfa->forward(offset, false);
+        if (dfa->failed)
+        {
+            return -1;
+        }
+        if (stop < 0)
+        {
+            return 0;
+        }
+    }
+    nrex_dfa* reverse = scratch->dfa(true, str, end);
+    int start = reverse->backward(stop, offset);
+    if (reverse->failed)
+    {
+        return -1;
+    }
+    if (start < 0)
+    {
+        return program->anchored_end ? 0 : -1;
+    }
+    span->start = start;
+    span->length = stop - start;
+    return 1;
+}
+
+// Building the DFAs only pays off if they are kept for later calls or the
+// text is long enough to make up for it.
+static bool nrex_lazy(const nrex_program* program, int offset, int end, const nrex_scratch* scratch)
+{
+    return program->reverse && offset <= end && (!scratch->transient || end - offset >= NREX_DFA_MIN_TEXT);
+}
+
+static bool nrex_execute(const nrex_program* program, int capturing, const nrex_char* str, nrex_result* captures, int offset, int end, nrex_scratch* scratch, int* hit)
+{
+    scratch->bind(program);
+    int* caps = scratch->registers();
+    bool found = false;
+    nrex_result span;
+    bool lazy = nrex_lazy(program, offset, end, scratch);
+    int located = lazy ? nrex_dfa_span(program, str, offset, end, scratch, &span) : -1;
+    if (located == 0)
+    {
+        found = false;
+    }
+    else if (located > 0 && capturing == 0)
+    {
+        found = true;
+        caps[0] = span.start;
+        caps[1] = span.start + span.length;
+    }
+    else if (located > 0)
+    {
+        // The match is known to start at span.start, so the NFA only has
+        // to run anchored there to sort out the captures. The text is not
+        // cut at the end of the span to keep the ending anchors and word
+        // boundaries seeing the real text.
+        nrex_pike vm(program, str, end, scratch->pike_levels());
+        NREX_COUNT(vm.counters = &scratch->counters);
+        found = vm.search(0, 0, span.start, caps, NULL);
+    }
+    else if (program->pike)
+    {
+        nrex_pike vm(program, str, end, scratch->pike_levels());
+        NREX_COUNT(vm.counters = &scratch->counters);
+        found = vm.search(0, 0, offset, caps, hit);
+    }
+    else
+    {
+        nrex_backtrack vm(program, str, end, caps, scratch->stack, scratch->budget, scratch->visited);
+        NREX_COUNT(vm.counters = &scratch->counters);
+        found = vm.search(offset, hit);
+    }
+    for (int c = 0; c <= capturing; ++c)
+    {
+        int start = caps[c * 2];
+        int stop = caps[c * 2 + 1];
+        if (found && start >= 0 && stop >= start)
+        {
+            captures[c].start = start;
+            captures[c].length = stop - start;
+        }
+        else
+        {
+            captures[c].start = 0;
+            captures[c].length = 0;
+        }
+    }
+    return found;
+}
+
+bool nrex::match(const nrex_char* str, nrex_result* captures, int offset, int end, nrex_match_context* context) const
+{
+    if (!_program)
+    {
+        return false;
+    }
+    if (end < offset)
+    {
+        end = NREX_STRLEN(str);
+    }
+    nrex_local_scratch local;
+    int hit = -1;
+    return nrex_execute(_program, _capturing, str, captures, offset, end, context ? context->_scratch : &local, &hit);
+}
+
+int nrex::match_all(const nrex_char* str, nrex_callback callback, void* data, int offset, int end, nrex_match_context* context) const
+{
+    if (!_program)
+    {
+        return 0;
+    }
+    if (end < offset)
+    {
+        end = NREX_STRLEN(str);
+    }
+    nrex_local_scratch local;
+    nrex_scratch* scratch = context ? context->_scratch : &local;
+    scratch->bind(_program);
+    scratch->local.lend(scratch->results, capture_size());
+    scratch->results.resize(capture_size());
+    nrex_result* captures = &scratch->results[0];
+    int count = 0;
+    int hit = -1;
+    while (offset <= end && nrex_execute(_program, _capturing, str, captures, offset, end, scratch, &hit))
+    {
+        ++count;
+        offset = captures[0].start + captures[0].length;
+        if (captures[0].length == 0)
+        {
+            offset = nrex_skip(str, offset, end);
+        }
+        if (!callback(captures, data))
+        {
+            break;
+        }
+    }
+    return count;
+}
+
+bool nrex::test(const nrex_char* str, int offset, int end, nrex_match_context* context) const
+{
+    if (!_program)
+    {
+        return false;
+    }
+    if (end < offset)
+    {
+        end = NREX_STRLEN(str);
+    }
+    nrex_local_scratch local;
+    nrex_scratch* scratch = context ? context->_scratch : &local;
+    scratch->bind(_program);
+    bool lazy = nrex_lazy(_program, offset, end, scratch);
+    if (lazy && _program->anchored_end)
+    {
+        nrex_result span;
+        int located = nrex_dfa_span(_program, str, offset, end, scratch, &span);
+        if (located >= 0)
+        {
+            return located > 0;
+        }
+    }
+    else if (lazy)
+    {
+        nrex_dfa* dfa = scratch->dfa(false, str, end);
+        int found = dfa->forward(offset, true);
+        if (!dfa->failed)
+        {
+            return found >= 0;
+        }
+    }
+    nrex_result span;
+    int hit = -1;
+    return nrex_execute(_program, 0, str, &span, offset, end, scratch, &hit);
+}
+
+bool nrex::search_span(const nrex_char* str, nrex_result* span, int offset, int end, nrex_match_context* context) const
+{
+    if (!_program)
+    {
+        return false;
+    }
+    if (end < offset)
+    {
+        end = NREX_STRLEN(str);
+    }
+    nrex_local_scratch local;
+    nrex_scratch* scratch = context ? context->_scratch : &local;
+    scratch->bind(_program);
+    int hit = -1;
+    return nrex_execute(_program, 0, str, span, offset, end, scratch, &hit);
+}
+
+nrex_set::nrex_set()
+    : _members(NULL)
+    , _size(0)
+    , _reserved(0)
+    , _program(NULL)
+{
+}
+
+nrex_set::~nrex_set()
+{
+    reset();
+}
+
+void nrex_set::reset()
+{
+    for (int i = 0; i < _size; ++i)
+    {
+        NREX_DELETE(_members[i]);
+    }
+    if (_members)
+    {
+        NREX_DELETE_ARRAY(_members);
+    }
+    if (_program)
+    {
+        NREX_DELETE(_program);
+    }
+    _context.reset();
+    _members = NULL;
+    _size = 0;
+    _reserved = 0;
+    _program = NULL;
+}
+
+int nrex_set::size() const
+{
+    return _size;
+}
+
+int nrex_set::add(const nrex_char* pattern)
+{
+    nrex* member = NREX_NEW(nrex(pattern));
+    if (!member->valid())
+    {
+        NREX_DELETE(member);
+        return -1;
+    }
+    if (_size == _reserved)
+    {
+        _reserved = _reserved ? _reserved * 2 : 8;
+        nrex** members = NREX_NEW_ARRAY(nrex*, _reserved);
+        for (int i = 0; i < _size; ++i)
+        {
+            members[i] = _members[i];
+        }
+        if (_members)
+        {
+            NREX_DELETE_ARRAY(_members);
+        }
+        _members = members;
+    }
+    if (_program)
+    {
+        NREX_DELETE(_program);
+        _program = NULL;
+        _context.reset();
+    }
+    _members[_size] = member;
+    return _size++;
+}
+
+bool nrex_set::compile()
+{
+    if (_program)
+    {
+        NREX_DELETE(_program);
+        _program = NULL;
+        _context.reset();
+    }
+    int members = 0;
+    for (int i = 0; i < _size; ++i)
+    {
+        if (_members[i]->_program->combinable())
+        {
+            ++members;
+        }
+    }
+    if (members == 0)
+    {
+        return false;
+    }
+    nrex_program* program = NREX_NEW(nrex_program(0));
+    for (int i = 0; i + 1 < members; ++i)
+    {
+        program->emit(nrex_op_split, 0, i + 1);
+    }
+    program->emit(nrex_op_jump);
+    int fork = 0;
+    for (int i = 0; i < _size; ++i)
+    {
+        if (_members[i]->_program->combinable())
+        {
+            // Appending may move the code, so the split is only looked up
+            // once it is done.
+            int start = program->append(_members[i]->_program, i);
+            program->code[fork++].x = start;
+        }
+    }
+    nrex_build_classes(program);
+    program->members = members;
+    program->pack();
+    program->signature = program->digest();
+    _program = program;
+    return true;
+}
+
+int nrex_set::match(const nrex_char* str, bool* matched, nrex_result* spans, int offset, int end, nrex_match_context* context) const
+{
+    if (end < offset)
+    {
+        end = NREX_STRLEN(str);
+    }
+    for (int i = 0; i < _size; ++i)
+    {
+        matched[i] = false;
+    }
+    bool scanned = false;
+    if (_program)
+    {
+        nrex_scratch* scratch = _context._scratch;
+        scratch->bind(_program);
+        scanned = scratch->dfa(false, str, end)->scan(offset, matched);
+    }
+    int count = 0;
+    for (int i = 0; i < _size; ++i)
+    {
+        if (!scanned || !_members[i]->_program->combinable())
+        {
+            matched[i] = _members[i]->test(str, offset, end, context);
+        }
+        if (matched[i] && spans)
+        {
+            _members[i]->search_span(str, &spans[i], offset, end, context);
+        }
+        count += matched[i] ? 1 : 0;
+    }
+    return count;
+}
+
+nrex_iterator::nrex_iterator(const nrex& regex, const nrex_char* str, int offset, int end)
+    : _regex(&regex)
+    , _str(str)
+    , _pos(offset)
+    , _end(end)
+    , _hit(-1)
+{
+    if (_end < _pos)
+    {
+        _end = NREX_STRLEN(str);
+    }
+}
+
+bool nrex_iterator::next(nrex_result* captures)
+{
+    if (!_regex->_program || _pos > _end)
+    {
+        return false;
+    }
+    if (!nrex_execute(_regex->_program, _regex->_capturing, _str, captures, _pos, _end, _context._scratch, &_hit))
+    {
+        _pos = _end + 1;
+        return false;
+    }
+    _pos = captures[0].start + captures[0].length;
+    if (captures[0].length == 0)
+    {
+        _pos = nrex_skip(_str, _pos, _end);
+    }
+    return true;
+}
+
+nrex_stream::nrex_stream(const nrex& regex, nrex_stream_callback callback, void* data)
+    : _regex(&regex)
+    , _callback(callback)
+    , _data(data)
+{
+    reset();
+}
+
+bool nrex_stream::valid() const
+{
+    return _regex->_program && _regex->_program->reverse;
+}
+
+void nrex_stream::reset()
+{
+    _pos = 0;
+    _state = 1 + NREX_DFA_ORIGIN;
+    _word = false;
+    _stopped = false;
+#ifdef NREX_UTF8
+    _pending = 0;
+#endif
+}
+
+int nrex_stream::run(const nrex_char* text, long base, int from, int until, int end)
+{
+    const nrex_program* program = _regex->_program;
+    nrex_scratch* scratch = _context._scratch;
+    scratch->bind(program);
+    nrex_dfa* dfa = scratch->dfa(false, NULL, 0);
+    dfa->streaming = true;
+    int state = _state;
+    int i = from;
+    while (i < until)
+    {
+        if (state <= 4 && program->first && until == end)
+        {
+            int next = program->first->scan(text, i, end);
+            if (next != i)
+            {
+                i = next;
+                state = 1 + (nrex_word_before(text, i) ? NREX_DFA_BEHIND_WORD : 0);
+                if (i >= end)
+                {
+                    break;
+                }
+            }
+        }
+        nrex_point c;
+        int after = nrex_next(text, i, end, &c);
+        int result = dfa->step(state, c, 0);
+        if (result & 1)
+        {
+            if (!_callback(base + i, _data))
+            {
+                _stopped = true;
+                return -1;
+            }
+            // Searching again from here, a match ending at the same
+            // position would be empty and is skipped.
+            bool behind_word = (i > from) ? nrex_word_before(text, i) : _word;
+            state = 1 + (behind_word ? NREX_DFA_BEHIND_WORD : 0) + (base + i == 0 ? NREX_DFA_ORIGIN : 0);
+            result = dfa->step(state, c, 0);
+        }
+        state = result >> 1;
+        i = after;
+    }
+    if (i > from)
+    {
+        _word = nrex_word_before(text, i);
+    }
+    _state = state;
+    return i;
+}
+
+#ifdef NREX_UTF8
+static int nrex_complete_length(const nrex_char* text, int length)
+{
+    for (int back = 1; back <= 3 && back <= length; ++back)
+    {
+        unsigned char lead = (unsigned char)text[length - back];
+        if ((lead & 0xC0) != 0x80)
+        {
+            int needed = (lead >= 0xF0) ? 4 : (lead >= 0xE0) ? 3 : 2;
+            if (0xC2 <= lead && lead <= 0xF4 && needed > back)
+            {
+                return length - back;
+            }
+            break;
+        }
+    }
+    return length;
+}
+#endif
+
+bool nrex_stream::feed(const nrex_char* chunk, int length)
+{
+    if (_stopped || !valid())
+    {
+        return false;
+    }
+    int from = 0;
+#ifdef NREX_UTF8
+    // A character cut at the end of the last chunk is finished with the
+    // first bytes of this one before the rest is searched in place.
+    if (_pending > 0)
+    {
+        nrex_char joined[8];
+        int carried = _pending;
+        int count = 0;
+        for (; count < carried; ++count)
+        {
+            joined[count] = _carry[count];
+        }
+        for (; count < 8 && count - carried < length; ++count)
+        {
+            joined[count] = chunk[count - carried];
+        }
+        int limit = nrex_complete_length(joined, count);
+        _pending = 0;
+        int stop = run(joined, _pos - carried, 0, (carried < limit) ? carried : limit, limit);
+        if (stop < 0)
+        {
+            return false;
+        }
+        if (stop < carried)
+        {
+            for (int i = stop; i < count; ++i)
+            {
+                _carry[_pending++] = joined[i];
+            }
+            _pos += length;
+            return true;
+        }
+        from = stop - carried;
+    }
+    int limit = nrex_complete_length(chunk, length);
+#else
+    int limit = length;
+#endif
+    if (run(chunk, _pos, from, limit, limit) < 0)
+    {
+        return false;
+    }
+#ifdef NREX_UTF8
+    for (int i = limit; i < length; ++i)
+    {
+        _carry[_pending++] = chunk[i];
+    }
+#endif
+    _pos += length;
+    return true;
+}
+
+bool nrex_stream::finish()
+{
+    if (_stopped || !valid())
+    {
+        return false;
+    }
+#ifdef NREX_UTF8
+    if (_pending > 0)
+    {
+        int carried = _pending;
+        _pending = 0;
+        if (run(_carry, _pos - carried, 0, carried, carried) < 0)
+        {
+            return false;
+        }
+    }
+#endif
+    _stopped = true;
+    const nrex_program* program = _regex->_program;
+    nrex_scratch* scratch = _context._scratch;
+    scratch->bind(program);
+    nrex_dfa* dfa = scratch->dfa(false, NULL, 0);
+    if (dfa->finish(_state, 0) & 1)
+    {
+        return _callback(_pos, _data);
+    }
+    return true;
+}
+
+long nrex_stream::position() const
+{
+    return _pos;
 }
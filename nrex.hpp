@@ -28,6 +28,11 @@
 #define NREX_HPP
 
 #include "nrex_config.h"
+#include <stddef.h>
+
+#if defined(NREX_UNICODE) && defined(NREX_UTF8)
+#error "NREX_UNICODE and NREX_UTF8 cannot be used together"
+#endif
 
 #ifdef NREX_UNICODE
 typedef wchar_t nrex_char;
@@ -49,7 +54,129 @@ struct nrex_result
         int length; /*!< Length of text range */
 };
 
-class nrex_node;
+class nrex_program;
+struct nrex_scratch;
+
+/*!
+ * \brief Called by nrex::match_all() for every match found
+ *
+ * \param captures  The capture results, same as in nrex::match(). Only
+ *                  valid during the call.
+ * \param data      The pointer given to nrex::match_all()
+ * \return          True to keep searching, False to stop
+ */
+typedef bool (*nrex_callback)(const nrex_result* captures, void* data);
+
+/*!
+ * \brief Called by nrex_stream for every match found
+ *
+ * \param end       The position just past the match, counted from the
+ *                  start of the stream
+ * \param data      The pointer given to the nrex_stream
+ * \return          True to keep searching, False to stop
+ */
+typedef bool (*nrex_stream_callback)(long end, void* data);
+
+/*!
+ * \brief Called now and then during a search to check for a deadline
+ *
+ * \param data      The pointer given to nrex_match_context::set_deadline()
+ * \return          True to give up the search, False to keep going
+ */
+typedef bool (*nrex_deadline_callback)(void* data);
+
+/*!
+ * \brief Working memory that can be reused between matches
+ *
+ * Passing the same context to every call keeps the thread lists, the
+ * backtracking stack and the states built by the DFA around, so matching
+ * repeatedly with the same regex does not allocate. A context may be
+ * used with any regex, but switching between them drops what was kept.
+ * It must not be used by two threads at once; keep one per thread.
+ * Without a context, searches for small patterns without lookahead run
+ * in a buffer on the stack and don't allocate either.
+ *
+ * A context can also bound the time taken by the backtracking machine,
+ * which patterns with backreferences, lookbehind, atomic groups or
+ * possessive quantifiers run on. A search that goes over the limits
+ * gives up and reports no match, and nrex_match_context::aborted() tells
+ * it apart from a search that found nothing.
+ */
+class nrex_match_context
+{
+    private:
+        nrex_scratch* _scratch;
+        nrex_match_context(const nrex_match_context&);
+        nrex_match_context& operator=(const nrex_match_context&);
+        friend class nrex;
+        friend class nrex_set;
+        friend class nrex_iterator;
+        friend class nrex_stream;
+    public:
+        nrex_match_context();
+
+        ~nrex_match_context();
+
+        /*!
+         * \brief Frees the memory kept from previous matches
+         *
+         * The limits set on the context are kept.
+         */
+        void reset();
+
+        /*!
+         * \brief Limits the steps the backtracking machine may take
+         *
+         * \param steps     The number of steps allowed in each search. 0 or
+         *                  less for no limit, which is the default.
+         */
+        void set_step_limit(long steps);
+
+        /*!
+         * \brief Sets a callback that can end a search early
+         *
+         * The callback is asked every few thousand steps of the
+         * backtracking machine, so it may read a clock.
+         *
+         * \param callback  Returns true once the search should give up.
+         *                  NULL to remove it.
+         * \param data      Passed on to the callback.
+         */
+        void set_deadline(nrex_deadline_callback callback, void* data);
+
+        /*!
+         * \brief Checks whether the last search gave up
+         * \return True if it went over the step limit or the deadline
+         */
+        bool aborted() const;
+
+        /*!
+         * \brief Provides the steps taken in the last search
+         * \return The number of steps of the backtracking machine. 0 if
+         *         the search ran on another engine.
+         */
+        long steps() const;
+
+#ifdef NREX_INSTRUMENT
+        /*!
+         * \brief Writes out where the engines spent their time
+         *
+         * Only built with NREX_INSTRUMENT. The counters add up over the
+         * searches run with this context since it last switched regex or
+         * was reset. The text gives the start positions tried, then a line
+         * for each instruction of the compiled regex with how often it was
+         * reached, passed and returned to by backtracking, followed by the
+         * part of the pattern it came from. Searches finished on the DFA are
+         * not counted.
+         *
+         * \param buffer    The buffer to write to. Can be NULL.
+         * \param size      The size of the buffer in characters.
+         * \return          The length of the text including the null
+         *                  terminator. 0 if no search was run yet.
+         */
+        int dump_stats(nrex_char* buffer, int size) const;
+#endif
+};
 
 /*!
  * \brief Holds the compiled regex pattern
@@ -58,8 +185,10 @@ class nrex
 {
     private:
         int _capturing;
-        unsigned int _lookahead_depth;
-        nrex_node* _root;
+        nrex_program* _program;
+        friend class nrex_set;
+        friend class nrex_iterator;
+        friend class nrex_stream;
     public:
 
         /*!
@@ -132,8 +261,60 @@ class nrex
          */
         bool compile(const nrex_char* pattern, int captures = 9);
 
+        /*!
+         * \brief Writes the compiled regex into a buffer
+         *
+         * The blob can be given to nrex::load() to skip parsing the pattern
+         * again. It only loads on a build with the same nrex_char, int size
+         * and byte order. If the buffer is NULL or too small nothing is
+         * written, so calling this with a size of 0 first gives the size to
+         * allocate.
+         *
+         * \param buffer    The buffer to write to. Can be NULL.
+         * \param size      The size of the buffer in bytes.
+         * \return          The size of the blob in bytes. 0 if there is no
+         *                  compiled regex.
+         */
+        int serialize(void* buffer, int size) const;
+
+        /*!
+         * \brief Loads a regex written by nrex::serialize()
+         *
+         * This automatically removes the existing compiled regex if already
+         * present. The blob is checked before use but is not copied, so it
+         * has to be aligned to 4 bytes and outlive this object or the next
+         * call to nrex::reset().
+         *
+         * \param buffer    The blob given by nrex::serialize()
+         * \param size      The size of the blob in bytes.
+         * \return          True if the blob was succesfully loaded
+         */
+        bool load(const void* buffer, int size);
+
         /*!
          * \brief Uses the pattern to search through the provided string
+         *
+         * Patterns without backreferences, lookbehind, atomic groups or
+         * possessive quantifiers are run on a Thompson NFA simulation which
+         * takes time linear to the length of the text. The exception is
+         * lookahead: it is searched afresh at every position a thread
+         * reaches it, so it can take time quadratic to the length of the
+         * text. Others fall back to a backtracking machine over the same
+         * compiled program. Unless the pattern has backreferences, counted
+         * repeats such as `{2,5}` or repeats of something that can match
+         * nothing such as `(a*)*`, the machine remembers where it has
+         * failed on shorter texts and never tries the same step at the same
+         * position twice. Otherwise it can take time exponential to the
+         * length of the text, which a nrex_match_context can put a limit
+         * on.
+         *
+         * Patterns that nrex::search_span() can run on the DFA are located
+         * that way first. The NFA then only runs from the start of the
+         * match to resolve the captures, or not at all if the regex was
+         * compiled without them. Patterns that end in `$` on every branch
+         * are read backwards from the end point, so a match at the end of
+         * a long line costs about the length of the match.
+         *
          * \param str       The text to search through. It only needs to be
          *                  null terminated if the end point is not provided.
          *                  This also determines the starting anchor.
@@ -149,9 +330,286 @@ class nrex
          *                  the ending anchor. If a number less than the offset
          *                  is provided, the search would be done until null
          *                  termination. Defaults to -1.
+         * \param context   Working memory to reuse between calls. If NULL
+         *                  the memory is allocated for this call only.
+         *                  Defaults to NULL.
          * \return          True if a match was found. False otherwise.
          */
-        bool match(const nrex_char* str, nrex_result* captures, int offset = 0, int end = -1) const;
+        bool match(const nrex_char* str, nrex_result* captures, int offset = 0, int end = -1, nrex_match_context* context = NULL) const;
+
+        /*!
+         * \brief Finds every match in the provided string
+         *
+         * Each search starts where the previous match ended. After an
+         * empty match the next search starts one character later, so an
+         * empty match is never reported twice at the same position. The
+         * working memory and the literal prefilter position are kept for
+         * the whole run and no results are stored.
+         *
+         * \param str       The text to search through.
+         * \param callback  Called with the captures of every match.
+         * \param data      Passed on to the callback.
+         * \param offset    The starting point of the search. Defaults to 0.
+         * \param end       The end point of the search. Same as in
+         *                  nrex::match(). Defaults to -1.
+         * \param context   Working memory to reuse between calls. Same as
+         *                  in nrex::match(). Defaults to NULL.
+         * \return          The number of matches found.
+         */
+        int match_all(const nrex_char* str, nrex_callback callback, void* data, int offset = 0, int end = -1, nrex_match_context* context = NULL) const;
+
+        /*!
+         * \brief Checks whether the pattern occurs in the provided string
+         *
+         * This gives the same answer as nrex::match() without resolving
+         * any of the captures. Patterns without backreferences or
+         * lookarounds are run on a lazily built DFA, taking about one table
+         * lookup per character. Characters above 0xFF are first sorted into
+         * classes through a small cache. The first NREX_DFA_WIDE_CLASSES
+         * classes get table columns, and characters of any later class are
+         * worked out one at a time.
+         *
+         * \param str       The text to search through.
+         * \param offset    The starting point of the search. Defaults to 0.
+         * \param end       The end point of the search. Same as in
+         *                  nrex::match(). Defaults to -1.
+         * \param context   Working memory to reuse between calls. If NULL
+         *                  the memory is allocated for this call only.
+         *                  Defaults to NULL.
+         * \return          True if a match was found. False otherwise.
+         */
+        bool test(const nrex_char* str, int offset = 0, int end = -1, nrex_match_context* context = NULL) const;
+
+        /*!
+         * \brief Finds the range of the first match without any captures
+         *
+         * The result is the same as the first result of nrex::match(). The
+         * same DFA as nrex::test() finds the end of the match and a second
+         * one running backwards from there finds its start. If the DFA
+         * runs out of room the search is finished on the other engines.
+         *
+         * \param str       The text to search through.
+         * \param span      The range of the entire match.
+         * \param offset    The starting point of the search. Defaults to 0.
+         * \param end       The end point of the search. Same as in
+         *                  nrex::match(). Defaults to -1.
+         * \param context   Working memory to reuse between calls. If NULL
+         *                  the memory is allocated for this call only.
+         *                  Defaults to NULL.
+         * \return          True if a match was found. False otherwise.
+         */
+        bool search_span(const nrex_char* str, nrex_result* span, int offset = 0, int end = -1, nrex_match_context* context = NULL) const;
+};
+
+/*!
+ * \brief Steps through the matches of a regex in a string one at a time
+ *
+ * This finds the same matches as nrex::match_all(). The string length is
+ * found once and the working memory is kept between matches. The regex
+ * and the string must outlive the iterator.
+ */
+class nrex_iterator
+{
+    private:
+        const nrex* _regex;
+        const nrex_char* _str;
+        int _pos;
+        int _end;
+        int _hit;
+        nrex_match_context _context;
+    public:
+
+        /*!
+         * \brief Starts iterating over the matches
+         *
+         * \param regex     The compiled regex
+         * \param str       The text to search through.
+         * \param offset    The starting point of the search. Defaults to 0.
+         * \param end       The end point of the search. Same as in
+         *                  nrex::match(). Defaults to -1.
+         */
+        nrex_iterator(const nrex& regex, const nrex_char* str, int offset = 0, int end = -1);
+
+        /*!
+         * \brief Finds the next match
+         *
+         * \param captures  The array of results to store the capture results.
+         *                  Same as in nrex::match().
+         * \return          True if a match was found. False when there are
+         *                  no more matches.
+         */
+        bool next(nrex_result* captures);
+};
+
+/*!
+ * \brief Searches text that arrives in chunks
+ *
+ * The text is given piece by piece to nrex_stream::feed() and the state
+ * of the DFA used by nrex::test() is carried from one chunk to the next,
+ * so nothing is copied and the memory used does not grow with the text.
+ * Only the end of each match is known, since the text before it may be
+ * gone. Each search starts where the previous match ended and stops at
+ * the earliest position where a match ends; an empty match is never
+ * reported twice at the same position. The end anchor only matches at
+ * nrex_stream::finish().
+ *
+ * Patterns with backreferences, lookarounds, atomic groups or possessive
+ * quantifiers cannot be streamed. The regex must outlive the stream.
+ */
+class nrex_stream
+{
+    private:
+        const nrex* _regex;
+        nrex_stream_callback _callback;
+        void* _data;
+        long _pos;
+        int _state;
+        bool _word;
+        bool _stopped;
+#ifdef NREX_UTF8
+        nrex_char _carry[4];
+        int _pending;
+#endif
+        nrex_match_context _context;
+        int run(const nrex_char* text, long base, int from, int until, int end);
+    public:
+
+        /*!
+         * \brief Starts a new stream
+         *
+         * \param regex     The compiled regex
+         * \param callback  Called with the end of every match found.
+         * \param data      Passed on to the callback.
+         */
+        nrex_stream(const nrex& regex, nrex_stream_callback callback, void* data);
+
+        /*!
+         * \brief Checks whether the regex can be streamed
+         * \return True if it can, False if it is empty or uses a feature
+         *         that needs the text before or after the current position
+         */
+        bool valid() const;
+
+        /*!
+         * \brief Discards the text seen so far and starts a new stream
+         */
+        void reset();
+
+        /*!
+         * \brief Searches the next chunk of the text
+         *
+         * \param chunk     The next part of the text. It does not need to be
+         *                  null terminated and is not kept after the call.
+         * \param length    The length of the chunk.
+         * \return          False if the regex cannot be streamed or the
+         *                  callback asked to stop. True otherwise.
+         */
+        bool feed(const nrex_char* chunk, int length);
+
+        /*!
+         * \brief Marks the end of the text
+         *
+         * This reports a match ending at the very end, such as one using
+         * the end anchor. Call nrex_stream::reset() to search another text.
+         *
+         * \return          False if the regex cannot be streamed or the
+         *                  callback asked to stop. True otherwise.
+         */
+        bool finish();
+
+        /*!
+         * \brief Provides the length of the text fed so far
+         * \return The number of characters given to nrex_stream::feed()
+         */
+        long position() const;
+};
+
+/*!
+ * \brief Holds many regex patterns to be matched in one pass
+ *
+ * After adding the patterns, nrex_set::compile() joins all those that can
+ * run on the DFA into a single automaton. Matching then reads the text
+ * once for all of them. Patterns with backreferences, lookarounds,
+ * atomic groups or possessive quantifiers are matched on their own.
+ */
+class nrex_set
+{
+    private:
+        nrex** _members;
+        int _size;
+        int _reserved;
+        nrex_program* _program;
+        nrex_match_context _context;
+        nrex_set(const nrex_set&);
+        nrex_set& operator=(const nrex_set&);
+    public:
+
+        /*!
+         * \brief Initialises an empty set
+         */
+        nrex_set();
+
+        ~nrex_set();
+
+        /*!
+         * \brief Removes all the patterns and frees up the memory
+         */
+        void reset();
+
+        /*!
+         * \brief Provides the number of patterns added
+         *
+         * This is used to provide the array size needed for nrex_set::match().
+         *
+         * \return The number of patterns
+         */
+        int size() const;
+
+        /*!
+         * \brief Compiles and adds a pattern to the set
+         *
+         * Patterns are compiled the same way as nrex::compile() with the
+         * default number of captures. The combined automaton is dropped
+         * until nrex_set::compile() is called again.
+         *
+         * \param pattern   The regex pattern
+         * \return          The id of the pattern, which counts up from 0.
+         *                  -1 if the pattern could not be compiled.
+         */
+        int add(const nrex_char* pattern);
+
+        /*!
+         * \brief Joins the added patterns into one automaton
+         *
+         * Without calling this every pattern is matched on its own.
+         *
+         * \return True if any of the patterns could be joined
+         */
+        bool compile();
+
+        /*!
+         * \brief Finds which patterns occur in the provided string
+         *
+         * The states of the combined automaton are kept in the set between
+         * calls, so a set must not be matched from two threads at once.
+         * The context is only used for patterns run on their own.
+         *
+         * \param str       The text to search through.
+         * \param matched   The array which is filled with whether each
+         *                  pattern matched, indexed by id. The size of that
+         *                  array needs to be the same as nrex_set::size().
+         * \param spans     If not NULL, filled with the range of the first
+         *                  match of each matched pattern, indexed by id.
+         *                  This runs each of those patterns again.
+         *                  Defaults to NULL.
+         * \param offset    The starting point of the search. Defaults to 0.
+         * \param end       The end point of the search. Same as in
+         *                  nrex::match(). Defaults to -1.
+         * \param context   Working memory to reuse between calls. Same as
+         *                  in nrex::match(). Defaults to NULL.
+         * \return          The number of patterns that matched.
+         */
+        int match(const nrex_char* str, bool* matched, nrex_result* spans = NULL, int offset = 0, int end = -1, nrex_match_context* context = NULL) const;
 };
 
 #ifdef NREX_THROW_ERROR
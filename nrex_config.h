@@ -3,6 +3,15 @@
 // Switches character type from char to wchar_t
 //#define NREX_UNICODE
 
+// Reads patterns and text as UTF-8 while keeping nrex_char as char.
+// Positions and lengths are still counted in bytes.
+//#define NREX_UTF8
+
+// Counts how often each instruction of a compiled pattern is reached,
+// passed and backtracked into, for nrex_match_context::dump_stats().
+// Slows matching down; leave it off outside of profiling builds.
+//#define NREX_INSTRUMENT
+
 // Throws error when there is a compilation error. Uses STL containers.
 //#define NREX_THROW_ERROR
 
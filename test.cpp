@@ -1,10 +1,13 @@
 #include "nrex.hpp"
 #include <locale>
 #include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
+#include <new>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #ifdef NREX_UNICODE
 typedef std::wstring string;
@@ -29,6 +32,92 @@ class ctype : public std::ctype<char>
         }
 };
 
+// Counts the allocations made while matching, which all go through the
+// global operator new unless NREX_NEW was changed.
+static long allocations = 0;
+
+#if __cplusplus < 201103L
+#define TEST_THROW throw(std::bad_alloc)
+#define TEST_NOTHROW throw()
+#else
+#define TEST_THROW
+#define TEST_NOTHROW noexcept
+#endif
+
+void* operator new(std::size_t size) TEST_THROW
+{
+    ++allocations;
+    void* data = std::malloc(size ? size : 1);
+    if (!data)
+    {
+        throw std::bad_alloc();
+    }
+    return data;
+}
+
+// Freed through a pointer the compiler cannot see into, or it pairs the
+// free() with the new expressions it inlines it into and warns.
+static void (*volatile release)(void*) = std::free;
+
+void operator delete(void* data) TEST_NOTHROW
+{
+    release(data);
+}
+
+#if __cplusplus >= 201402L
+void operator delete(void* data, std::size_t) noexcept
+{
+    release(data);
+}
+#endif
+
+bool count_match(const nrex_result*, void* data)
+{
+    ++*(int*)data;
+    return true;
+}
+
+#ifdef NREX_UTF8
+struct utf8_case
+{
+    const char* pattern;
+    const char* text;
+    int start;
+    int length;
+};
+
+const utf8_case utf8_cases[] = {
+    { "\xC3\xA9+", "caf\xC3\xA9\xC3\xA9!", 3, 4 },
+    { "^.$", "\xC3\xA9", 0, 2 },
+    { "^...$", "a\xE2\x82\xAC\xF0\x9F\x98\x80", 0, 8 },
+    { "[\xC3\xA0-\xC3\xBF]+", "na\xC3\xAFve", 2, 2 },
+    { "[^a]", "a\xC3\xA9", 1, 2 },
+    { "(?<=\xC3\xA9)x", "\xC3\xA9x", 2, 1 },
+    { "(?<=.)x", "\xE2\x82\xACx", 3, 1 },
+    { "\\xe9", "caf\xC3\xA9", 3, 2 },
+    { "\\u20ac", "5\xE2\x82\xAC", 1, 3 },
+    { "a.c", "a\x80" "c", 0, 3 },
+    { "(.)\\1", "\xC3\xA9\xC3\xA9", 0, 4 },
+    { ".x|\xC3\xA9", "\xC3\xA9", 0, 2 },
+    { "[a\xE2\x82\xAC\xC3\xA0-\xC3\xBF\\d]+", "x\xE2\x82\xAC" "9a\xC3\xA9!", 1, 7 },
+    { "[^\xE2\x82\xA0-\xE2\x82\xAF\xE2\x82\xAC]", "\xE2\x82\xAC\xC3\xA9", 3, 2 },
+    { "\\w+", "!caf\xC3\xA9 ", 1, 5 },
+    { "\\s", "a\xE3\x80\x80", 1, 3 },
+    { "\\b.", "\xC3\xA9!", 0, 2 },
+};
+#endif
+
+bool collect_end(long end, void* data)
+{
+    ((std::vector<long>*)data)->push_back(end);
+    return true;
+}
+
+bool give_up(void* data)
+{
+    return ++*(int*)data >= 2;
+}
+
 int main()
 {
     ifstream file("test.txt");
@@ -45,6 +134,11 @@ int main()
     std::locale locale(std::locale::classic(), new ctype);
 
     nrex n;
+    nrex loaded;
+    nrex_match_context context;
+    nrex_set set;
+    std::vector<string> patterns;
+    std::vector<string> texts;
     std::cout << "==================" << std::endl;
     while (!file.eof())
     {
@@ -87,6 +181,9 @@ int main()
         {
             text.clear();
         }
+        patterns.push_back(pattern);
+        texts.push_back(text);
+        set.add(pattern.c_str());
         nrex_result* results = new nrex_result[captures];
         bool found = n.match(text.c_str(), results);
 
@@ -101,6 +198,46 @@ int main()
             std::cout << position << " Got: " << results[0].start << std::endl;
         }
 
+        int size = n.serialize(NULL, 0);
+        int* blob = new int[size / sizeof(int)];
+        n.serialize(blob, size);
+        nrex_result* reloaded = new nrex_result[captures];
+        if (!loaded.load(blob, size) || loaded.match(text.c_str(), reloaded, 0, -1, &context) != found)
+        {
+            failed = true;
+            std::cout << "    Mismatched result after loading" << std::endl;
+        }
+        for (int i = 0; found && i < captures; i++)
+        {
+            if (reloaded[i].start != results[i].start || reloaded[i].length != results[i].length)
+            {
+                failed = true;
+                std::cout << "    Mismatched capture " << i << " after loading" << std::endl;
+            }
+        }
+        loaded.reset();
+        delete[] reloaded;
+        delete[] blob;
+
+        nrex_result span;
+        if (n.test(text.c_str()) != found || n.search_span(text.c_str(), &span) != found)
+        {
+            failed = true;
+            std::cout << "    Mismatched result without captures" << std::endl;
+        }
+        else if (n.test(text.c_str(), 0, -1, &context) != found || n.search_span(text.c_str(), &span, 0, -1, &context) != found)
+        {
+            failed = true;
+            std::cout << "    Mismatched result with a reused context" << std::endl;
+        }
+        else if (found && (span.start != results[0].start || span.length != results[0].length))
+        {
+            failed = true;
+            std::cout << "    Mismatched span. Expected: " << results[0].start;
+            std::cout << "+" << results[0].length << " Got: " << span.start;
+            std::cout << "+" << span.length << std::endl;
+        }
+
         for (int i = 0; i < captures; i++)
         {
             string result;
@@ -125,6 +262,49 @@ int main()
             }
         }
 
+        nrex_iterator iterator(n, text.c_str());
+        nrex_result* expected = new nrex_result[captures];
+        int matches = 0;
+        int offset = 0;
+        while (offset <= (int)text.length() && n.match(text.c_str(), expected, offset))
+        {
+            matches++;
+            offset = expected[0].start + expected[0].length + (expected[0].length == 0 ? 1 : 0);
+            if (!iterator.next(results) || results[0].start != expected[0].start || results[0].length != expected[0].length)
+            {
+                failed = true;
+                std::cout << "    Mismatched iterator at match " << matches << std::endl;
+                break;
+            }
+        }
+        int counted = 0;
+        if (iterator.next(results) || n.match_all(text.c_str(), count_match, &counted, 0, -1, &context) != matches || counted != matches)
+        {
+            failed = true;
+            std::cout << "    Mismatched number of matches. Expected: " << matches << std::endl;
+        }
+        delete[] expected;
+
+        std::vector<long> whole;
+        std::vector<long> pieces;
+        nrex_stream stream_whole(n, collect_end, &whole);
+        nrex_stream stream_pieces(n, collect_end, &pieces);
+        if (stream_whole.valid())
+        {
+            stream_whole.feed(text.c_str(), text.length());
+            stream_whole.finish();
+            for (unsigned int i = 0; i < text.length(); i++)
+            {
+                stream_pieces.feed(text.c_str() + i, 1);
+            }
+            stream_pieces.finish();
+            if (whole != pieces || whole.empty() == n.test(text.c_str()))
+            {
+                failed = true;
+                std::cout << "    Mismatched stream" << std::endl;
+            }
+        }
+
         if (!failed)
         {
             std::cout << "    OK" << std::endl;
@@ -137,6 +317,259 @@ int main()
 
         delete[] results;
     }
+    tests++;
+    std::cout << "Set" << std::endl;
+    set.compile();
+    bool* matched = new bool[set.size()];
+    nrex_result* spans = new nrex_result[set.size()];
+    bool set_failed = (set.size() != (int)patterns.size());
+    for (unsigned int i = 0; i < texts.size() && !set_failed; i++)
+    {
+        set.match(texts[i].c_str(), matched, spans, 0, -1, &context);
+        for (unsigned int j = 0; j < patterns.size(); j++)
+        {
+            n.compile(patterns[j].c_str());
+            nrex_result span;
+            bool found = n.search_span(texts[i].c_str(), &span);
+            if (found != matched[j] || (found && (span.start != spans[j].start || span.length != spans[j].length)))
+            {
+                set_failed = true;
+                std::cout << "    Mismatched pattern " << j << " on text " << i << std::endl;
+            }
+        }
+    }
+    delete[] matched;
+    delete[] spans;
+    if (!set_failed)
+    {
+        std::cout << "    OK" << std::endl;
+        passed++;
+    }
+    else
+    {
+        std::cout << "    FAILED (Set)" << std::endl;
+    }
+
+    tests++;
+    std::cout << "Budget" << std::endl;
+    std::string runaway(30, 'x');
+    n.compile("(x+x+)+\\1(?<=y)");
+    nrex_result* budget_results = new nrex_result[n.capture_size()];
+    nrex_match_context limited;
+    limited.set_step_limit(100000);
+    bool budget_failed = n.match(runaway.c_str(), budget_results, 0, -1, &limited);
+    budget_failed = budget_failed || !limited.aborted() || limited.steps() <= 100000;
+    int deadline_calls = 0;
+    limited.set_step_limit(0);
+    limited.set_deadline(give_up, &deadline_calls);
+    budget_failed = budget_failed || n.match(runaway.c_str(), budget_results, 0, -1, &limited);
+    budget_failed = budget_failed || !limited.aborted() || deadline_calls != 2;
+    limited.set_deadline(NULL, NULL);
+    limited.set_step_limit(100000);
+    n.compile("(x+x+)+(?<=y)");
+    budget_failed = budget_failed || n.match(runaway.c_str(), budget_results, 0, -1, &limited) || limited.aborted();
+    std::string nested = std::string(30, 'a') + "!b";
+    n.compile("(a*)*b");
+    budget_failed = budget_failed || !n.match(nested.c_str(), budget_results, 0, -1, &limited) || limited.aborted();
+    n.compile("(x+x+)+y");
+    budget_failed = budget_failed || n.match((runaway + "!y").c_str(), budget_results, 0, -1, &limited) || limited.aborted();
+    n.compile("(x+)(?<=x)");
+    budget_failed = budget_failed || !n.match(runaway.c_str(), budget_results, 0, -1, &limited);
+    budget_failed = budget_failed || limited.aborted() || limited.steps() == 0;
+    delete[] budget_results;
+    if (!budget_failed)
+    {
+        std::cout << "    OK" << std::endl;
+        passed++;
+    }
+    else
+    {
+        std::cout << "    FAILED (Budget)" << std::endl;
+    }
+
+    tests++;
+    std::cout << "Long pattern" << std::endl;
+    std::string long_pattern(1000000, 'a');
+    nrex_result long_results[1];
+    bool long_failed = !n.compile(long_pattern.c_str(), 0);
+    long_failed = long_failed || !n.match((long_pattern + "b").c_str(), long_results) || long_results[0].length != 1000000;
+    long_failed = long_failed || n.match(long_pattern.c_str() + 1, long_results);
+    if (!long_failed)
+    {
+        std::cout << "    OK" << std::endl;
+        passed++;
+    }
+    else
+    {
+        std::cout << "    FAILED (Long pattern)" << std::endl;
+    }
+
+    tests++;
+    std::cout << "Corrupt blob" << std::endl;
+    n.compile("[[:alpha:]]+x");
+    int blob_size = n.serialize(NULL, 0);
+    int* corrupt = new int[blob_size / sizeof(int)];
+    n.serialize(corrupt, blob_size);
+    bool corrupt_failed = !loaded.load(corrupt, blob_size);
+    int classes_found = 0;
+    for (int i = 0; i + 3 < blob_size / (int)sizeof(int); i++)
+    {
+        // A class item for [:alpha:], given a type past the last class.
+        if (corrupt[i] == 3 && corrupt[i + 1] == 2 && corrupt[i + 2] == 0 && corrupt[i + 3] == 0)
+        {
+            corrupt[i + 1] = 40;
+            classes_found++;
+        }
+    }
+    corrupt_failed = corrupt_failed || classes_found == 0 || loaded.load(corrupt, blob_size);
+    loaded.reset();
+    delete[] corrupt;
+    if (!corrupt_failed)
+    {
+        std::cout << "    OK" << std::endl;
+        passed++;
+    }
+    else
+    {
+        std::cout << "    FAILED (Corrupt blob)" << std::endl;
+    }
+
+#ifndef NREX_INSTRUMENT
+    tests++;
+    std::cout << "Allocations" << std::endl;
+    const char* quiet_patterns[] = { "(\\w+)@(\\w+)", "\\d+", "abc", "(a)\\1", "^(?:a|b)*c$" };
+    // The long text is past the length the DFAs are built for.
+    std::string quiet_long;
+    while (quiet_long.size() < 300)
+    {
+        quiet_long += "user foo@example 1234 ab abc ";
+    }
+    const char* quiet_texts[] = { "user foo@example 1234 ab abc", quiet_long.c_str() };
+    bool allocations_failed = false;
+    for (unsigned int i = 0; i < sizeof(quiet_patterns) / sizeof(quiet_patterns[0]); i++)
+    {
+        n.compile(quiet_patterns[i]);
+        nrex_result* quiet_results = new nrex_result[n.capture_size()];
+        for (unsigned int j = 0; j < sizeof(quiet_texts) / sizeof(quiet_texts[0]); j++)
+        {
+            long before = allocations;
+            n.match(quiet_texts[j], quiet_results);
+            n.test(quiet_texts[j]);
+            if (allocations != before)
+            {
+                allocations_failed = true;
+                std::cout << "    Allocated " << allocations - before << " times on pattern " << i << ", text " << j << std::endl;
+            }
+        }
+        delete[] quiet_results;
+    }
+    if (!allocations_failed)
+    {
+        std::cout << "    OK" << std::endl;
+        passed++;
+    }
+    else
+    {
+        std::cout << "    FAILED (Allocations)" << std::endl;
+    }
+#endif
+
+#ifdef NREX_INSTRUMENT
+    tests++;
+    std::cout << "Instrument" << std::endl;
+    n.compile("(a|ab)(?<=b)c");
+    nrex_result* stats_results = new nrex_result[n.capture_size()];
+    nrex_match_context counted;
+    bool stats_failed = !n.match("xabc", stats_results, 0, -1, &counted);
+    std::vector<char> stats(counted.dump_stats(NULL, 0));
+    stats_failed = stats_failed || stats.empty() || counted.dump_stats(&stats[0], stats.size()) != (int)stats.size();
+    std::string dump = stats.empty() ? std::string() : std::string(&stats[0]);
+    stats_failed = stats_failed || dump.compare(0, 9, "starts 1\n") != 0;
+    stats_failed = stats_failed || dump.find(" look_behind            2          1          0 (?<=b)\n") == std::string::npos;
+    stats_failed = stats_failed || dump.find(" char                   1          1          1 a\n") == std::string::npos;
+    counted.reset();
+    stats_failed = stats_failed || counted.dump_stats(NULL, 0) != 0;
+    delete[] stats_results;
+    if (!stats_failed)
+    {
+        std::cout << "    OK" << std::endl;
+        passed++;
+    }
+    else
+    {
+        std::cout << "    FAILED (Instrument)" << std::endl;
+    }
+#endif
+
+#ifdef NREX_UTF8
+    tests++;
+    std::cout << "UTF-8" << std::endl;
+    bool utf8_failed = false;
+    for (unsigned int i = 0; i < sizeof(utf8_cases) / sizeof(utf8_cases[0]); i++)
+    {
+        const utf8_case& test = utf8_cases[i];
+        n.compile(test.pattern);
+        nrex_result* results = new nrex_result[n.capture_size()];
+        bool found = n.match(test.text, results);
+        if (!found || results[0].start != test.start || results[0].length != test.length)
+        {
+            utf8_failed = true;
+            std::cout << "    Mismatched case " << i << std::endl;
+        }
+        delete[] results;
+    }
+    int empty = 0;
+    n.compile("x*");
+    if (n.match_all("\xC3\xA9\xC3\xA9", count_match, &empty) != 3 || n.compile("\xC3"))
+    {
+        utf8_failed = true;
+        std::cout << "    Mismatched empty matches or invalid pattern" << std::endl;
+    }
+    std::vector<long> split;
+    n.compile("\xC3\xA9");
+    nrex_stream stream(n, collect_end, &split);
+    stream.feed("caf\xC3", 4);
+    stream.feed("\xA9", 1);
+    stream.finish();
+    if (split.size() != 1 || split[0] != 5)
+    {
+        utf8_failed = true;
+        std::cout << "    Mismatched stream across a split character" << std::endl;
+    }
+    n.compile(".(.)");
+    nrex_result inside[2];
+    nrex_result inside_span;
+    if (!n.match("x\xE2\x82\xACx", inside, 3) || inside[0].start != 3 || inside[1].start != 4
+        || !n.search_span("x\xE2\x82\xACx", &inside_span, 3) || inside_span.start != 3 || inside_span.length != 2)
+    {
+        utf8_failed = true;
+        std::cout << "    Mismatched search from inside a character" << std::endl;
+    }
+    std::string wide_text;
+    for (int i = 0; i < 200; i++)
+    {
+        wide_text += "\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E\xE4\xB8\xAD\xE6\x96\x87\xE6\xBC\xA2\xE5\xAD\x97\xE3\x81\x82\xE3\x81\x84\xE3\x80\x80";
+    }
+    n.compile("\\w+\xE3\x81\x84q");
+    bool wide_failed = n.test(wide_text.c_str(), 0, -1, &context) || !n.test((wide_text + "\xE8\xAA\x9E\xE3\x81\x84q").c_str(), 0, -1, &context);
+    n.compile("(?:\xE6\x97\xA5|\xE6\x9C\xAC|\xE8\xAA\x9E|\xE4\xB8\xAD|\xE6\x96\x87|\xE6\xBC\xA2|\xE5\xAD\x97|\xE3\x81\x82|\xE3\x81\x84)+q");
+    wide_failed = wide_failed || n.test(wide_text.c_str(), 0, -1, &context) || !n.test((wide_text.substr(0, 27) + "q").c_str(), 0, -1, &context);
+    if (wide_failed)
+    {
+        utf8_failed = true;
+        std::cout << "    Mismatched DFA over characters above 0xFF" << std::endl;
+    }
+    if (!utf8_failed)
+    {
+        std::cout << "    OK" << std::endl;
+        passed++;
+    }
+    else
+    {
+        std::cout << "    FAILED (UTF-8)" << std::endl;
+    }
+#endif
+
     std::cout << "==================" << std::endl;
     std::cout << "Tests: " << tests << std::endl;
     std::cout << "Successes: " << passed << std::endl;